@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 #include <avr/pgmspace.h>
 #include <uzebox.h>
@@ -22,10 +23,29 @@
 #include "data/patches.inc"
 #include "data/music.inc"
 
+#define SPIBUS_IDLE			0
+#define SPIBUS_RAM_READ		1
+#define SPIBUS_RAM_WRITE	2
+#define SPIBUS_SD			3
+
+//every FatFs call gets the bus from the arbiter first, an open SPI RAM sequence is ended
+void spibus_Sd();
+#define f_mount(...)	(spibus_Sd(), f_mount(__VA_ARGS__))
+#define f_open(...)		(spibus_Sd(), f_open(__VA_ARGS__))
+#define f_close(...)	(spibus_Sd(), f_close(__VA_ARGS__))
+#define f_read(...)		(spibus_Sd(), f_read(__VA_ARGS__))
+#define f_write(...)	(spibus_Sd(), f_write(__VA_ARGS__))
+#define f_lseek(...)	(spibus_Sd(), f_lseek(__VA_ARGS__))
+#define f_stat(...)		(spibus_Sd(), f_stat(__VA_ARGS__))
+#define f_opendir(...)	(spibus_Sd(), f_opendir(__VA_ARGS__))
+#define f_readdir(...)	(spibus_Sd(), f_readdir(__VA_ARGS__))
+#define f_truncate(...)	(spibus_Sd(), f_truncate(__VA_ARGS__))
+
 #define Wait200ns() asm volatile("lpm\n\tlpm\n\t");
 #define Wait100ns() asm volatile("lpm\n\t");
 
 #define kAutorunFilename "AUTORUN.BAS"
+#define kAutorunImageFilename "AUTORUN.BIN"//cached image of kAutorunFilename
 
 #define PM_INPUT	0
 #define PM_OUTPUT	1
@@ -41,6 +61,9 @@
 #define STRING_BUFFER_SIZE 2 //string buffer
 #define HIGHLOW_HIGH	1
 #define HIGHLOW_UNKNOWN	4
+#define SD_SECTOR_SIZE	512
+#define SPIR_LOAD_CHUNK	(SD_SECTOR_SIZE*2)//largest multi-sector read DLOAD will do
+#define DLOAD_TO_EOF	999999UL
 
 ////////////////////
 //ASCII Characters
@@ -54,6 +77,7 @@
 #define DQUOTE	'\"'
 #define CTRLC	0x03
 #define CTRLH	0x08
+#define CTRLQ	0x11
 #define CTRLS	0x13
 #define CTRLX	0x18
 
@@ -64,13 +88,37 @@ typedef u16 LINENUM;
 #define SPIR_INITIALIZED	2
 #define DO_SONG_BUFFER		4
 #define INHIBIT_PROMPT_ONCE	8//use PROMPT 0 to "permanently" inhibit
+#define AUTORUN_PENDING		16//start the autorun program once the SD card is mounted
+#define AUTORUN_CACHE		32//save kAutorunImageFilename once the text autorun has loaded
+
+#define SD_MOUNT_TRIES		10
+#define SD_RETRY_FRAMES		30
+#define RESUME_MAGIC		0x5A3C
 
 //these will select, at runtime, where IO happens through for load/save
 enum{
 	kStreamSerial = 0,
 	kStreamFile,
 	kStreamKeyboard,
-	kStreamScreen
+	kStreamScreen,
+	kStreamSpiRam,
+	kStreamNull,
+	kStreamHandle//PRINT #/INPUT #, not selectable with REDIRI/REDIRO
+};
+
+#define STREAM_EOF	-1
+#define STREAM_NOKEY	-2//nothing typed, give the prompt loop a turn
+#define STREAM_FILE_BUF_SIZE	64
+#define STREAM_NO_LIMIT			0xFFFFFFFFUL
+#define STREAM_SERIAL_BUF_SIZE	16//must be a power of 2
+#define FILE_BUF_IDLE	0
+#define FILE_BUF_READ	1
+#define FILE_BUF_WRITE	2
+
+struct stream_driver{
+	s16 (*get)();//returns STREAM_EOF once there is nothing more to read
+	void (*put)(char c);
+	void (*flush)();
 };
 
 struct stack_for_frame{
@@ -83,6 +131,154 @@ struct stack_for_frame{
 	u8 *exit_pos;
 };
 
+#define IMAGE_MAGIC0	0xB5
+#define IMAGE_MAGIC1	'U'
+#define IMAGE_VERSION	1
+#define IMAGE_VARS_SIZE	(27*VAR_SIZE)
+#define IMAGE_NONE		0
+#define IMAGE_LOADED	1
+#define IMAGE_BAD		2
+#define IMAGE_STALE		3
+
+struct image_source{
+	u32 size;
+	u16 date;
+	u16 time;
+};
+
+struct program_image_header{
+	u8 magic[2];
+	u8 version;
+	u8 var_size;//VAR_SIZE the image was saved with
+	u16 ram_size;//RAM_SIZE the image was saved with
+	u16 program_len;
+	LINENUM last_linenum;
+	struct image_source src;//file the image was built from, zero if saved directly
+	u16 checksum;//over the program and the variables
+};
+
+#define OVERLAY_SEGMENTS	4
+#define OVERLAY_UNINDEXED	0xFFFFFFFFUL
+
+struct overlay_segment{
+	char fname[13];
+	LINENUM first;
+	LINENUM last;
+	u32 offset;//where the segment starts in the file, OVERLAY_UNINDEXED until a load has passed it
+};
+
+#define SPIR_SIZE		0x20000UL//128K SPI RAM, PEEK/POKE addresses from RAM_SIZE up reach it directly, up to SPIR_USER_TOP
+#define BANK_SLOTS		8
+#define BANK_SLOT_SIZE	2048//a bank_header and RAM_SIZE must fit
+#define BANK_BASE		(SPIR_SIZE-(BANK_SLOTS*BANK_SLOT_SIZE))//top of the SPI RAM
+#define BANK_MAGIC		0xBA4C
+
+struct bank_header{
+	u16 magic;
+	u16 program_len;
+	LINENUM last_linenum;
+	u8 *sp;//interpreter state, program[] doesn't move so these stay valid
+	u8 *current_line;
+	u8 *txtpos;
+	u16 checksum;//over the program, variables and stack
+};
+
+#define SNAPSHOT_MAGIC		0x534E
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_NO_SONG	0xFF
+#define SNAPSHOT_SIZE		(sizeof(struct snapshot_header)+RAM_SIZE+VRAM_SIZE)
+#define SNAPSHOT_BASE		((BANK_BASE-SNAPSHOT_SIZE)&~0x1FFUL)//just below the program banks
+
+struct snapshot_header{
+	u16 magic;
+	u8 version;
+	u16 ram_size;
+	u16 vram_size;
+	u16 program_len;
+	LINENUM last_linenum;
+	u8 *sp;
+	u8 *current_line;
+	u8 *txtpos;
+	terminal_state_t term;
+	u8 song;//SNAPSHOT_NO_SONG if nothing was playing
+	u16 song_pos;
+	u32 song_base;
+	u32 song_off;
+	u8 bank;
+	u16 checksum;//over program[] and vram
+};
+
+#define FCACHE_DIR_ENTRIES	64
+#define FCACHE_DIR_UNKNOWN	0xFF
+#define FCACHE_FILES		8
+#define FCACHE_MAP_SIZE		16//DWORDs, a file in up to 7 fragments gets a link map
+#define FCACHE_DIR_BASE		(SNAPSHOT_BASE-(FCACHE_DIR_ENTRIES*sizeof(FILINFO)))
+#define FCACHE_FILE_BASE	(FCACHE_DIR_BASE-(FCACHE_FILES*sizeof(struct fcache_file)))
+
+struct fcache_file{
+	char fname[13];
+	FIL fil;//valid while the volume stays mounted and nothing is written
+#if _USE_FASTSEEK
+	DWORD linkmap[FCACHE_MAP_SIZE];//linkmap[0] is 0 if the file has none
+#endif
+};
+
+#define PAK_VERSION		1
+#define PAK_NAME_LEN	16
+#define PAK_TO_SPIRAM	0
+#define PAK_TO_VRAM		1
+
+struct pak_header{
+	char magic[4];//"UZPK"
+	u16 version;
+	u16 count;
+};
+
+struct pak_entry{
+	char name[PAK_NAME_LEN];//upper case, zero padded
+	u32 offset;
+	u32 size;
+};
+
+#define PACK_MAGIC0		0xB5
+#define PACK_MAGIC1		'Z'
+#define PACK_RLE		1
+#define PACK_LZ4		2
+#define PACK_NONE		0//unpack_Probe(): raw data
+#define PACK_FOUND		1//packed and fits
+#define PACK_TOO_BIG	2//packed, but unpacks past the room given
+
+struct packed_header{
+	u8 magic[2];
+	u8 method;
+	u32 size;//unpacked
+};
+
+#define ALOAD_IDLE		0
+#define ALOAD_BUSY		1
+#define ALOAD_DONE		2
+#define ALOAD_ERROR		3
+
+#define FIO_HANDLES		4
+#define FIO_NONE		0xFF
+#define FIO_READ		1
+#define FIO_WRITE		2
+#define FIO_TRUNCATE	4//preallocated, cut back to the written length on CLOSE
+#define FIO_BASE		(FCACHE_FILE_BASE-(FIO_HANDLES*sizeof(FIL)))
+
+#define SCROLLBACK_LINES	192//rows of terminal history, the live screen is parked after them while viewing
+#define SCROLLBACK_BASE		(FIO_BASE-((SCROLLBACK_LINES+SCREEN_TILES_V)*(u32)VRAM_TILES_H))
+
+//SPI RAM from SPIR_USER_TOP up holds, from the top down: program banks, the snapshot, the file
+//cache, file handles and the scrollback. PEEK/POKE, DLOAD, PLOAD, ALOAD and SPOS stop below it.
+#define SPIR_USER_TOP		SCROLLBACK_BASE
+
+//TERM: the kernel's UART Rx ring is the only buffer, the host is held off with XON/XOFF before it fills
+#define TERM_EXIT		0x1D//Ctrl+], as in telnet
+#define TERM_SPAN		32//bytes handed to the terminal at once
+#define TERM_XOFF_LEVEL	(UART_RX_BUFFER_SIZE/2)//the other half soaks up what USB adapters still send after XOFF
+#define TERM_XON_LEVEL	(UART_RX_BUFFER_SIZE/8)
+
 struct stack_gosub_frame{
 	char frame_type;
 	u8 *current_line;
@@ -100,8 +296,33 @@ void pinMode(u8 pin, u8 mode);
 static s16 inchar();
 static void outchar(char c);
 static void line_terminator();
+static void outspan(const u8 *s, u16 len);
 static VAR_TYPE expression();
 static bool breakcheck();
+static void stream_SetIn(u8 s);
+static void stream_SetOut(u8 s);
+static void stream_Flush(u8 s);
+static s16 stream_NullGet();
+static void stream_NullPut(char c);
+static void stream_NullFlush();
+static s16 stream_KeyboardGet();
+static s16 stream_HandleGet();
+static void stream_HandlePut(char c);
+static void stream_ScreenPut(char c);
+static s16 stream_SerialGet();
+static void stream_SerialPut(char c);
+static void stream_SerialDrain();
+static void stream_SerialFlush();
+static void stream_FileReset();
+static s16 stream_FileGet();
+static s16 stream_FileGetRaw();
+static void stream_FileLimit(u32 len);
+static void stream_FilePut(char c);
+static void stream_FileFlush();
+static void stream_FileClose();
+static s16 stream_SpiRamGet();
+static void stream_SpiRamPut(char c);
+static void stream_SpiRamFlush();
 void cmd_Files();
 char *filenameWord();
 void dump_mem(u16 start_addr,u8 rows);
@@ -112,7 +333,45 @@ uint8_t SpiRamCursorReadBuffered(uint32_t addr);
 void SpiRamCursorWrite(uint32_t addr, uint8_t val);
 void SpiRamCursorYield();
 void SpiRamCursorUnyield();
+void SpiRamCacheInvalidate();
+void SpiRamBlockWrite(uint32_t addr, const void *src, u16 len);
+void SpiRamBlockRead(uint32_t addr, void *dst, u16 len);
 u8 SpiRamCursorLoad(char *fname, u32 foff, u32 dlen, u32 roff);
+static bool image_IsName(const char *fname);
+static u8 image_Save(const char *fname, const struct image_source *src);
+static u8 image_Load(const struct image_source *src, bool keep_vars);
+static u8 sd_Poll();
+static void sd_WaitReady();
+static u8 autorun_Start();
+static bool resume_Check();
+static void overlay_Reset();
+static void bank_Save(u8 n);
+static u8 bank_Load(u8 n);
+static u8 snapshot_Save(u32 *addr);
+static u8 snapshot_Restore(u32 *addr);
+static void fcache_Invalidate();
+static FRESULT fcache_Stat(const char *fname, FILINFO *info);
+static FRESULT fcache_Open(const char *fname);
+static bool pak_Open(const char *fname);
+static bool pak_Find(const char *name, struct pak_entry *e);
+static u8 unpack_Probe(struct packed_header *h, u32 room);
+static u8 unpack_Run(const struct packed_header *h, u8 where, u32 dest, u32 room);
+static u8 aload_Start(const char *fname, u32 foff, u32 len, u32 dest);
+static void aload_Step();
+static void aload_Idle();
+static void aload_Finish();
+static void fio_Claim();
+static void fio_Use(u8 n);
+static void term_Run();
+static void scrollback_Write(u16 row, const u8 *tiles);
+static void scrollback_Read(u16 row, u8 *tiles);
+static bool fio_Valid(VAR_TYPE n, u8 mode);
+static u8 fio_Open(u8 n, const char *fname, char mode, u32 prealloc);
+static void fio_Close(u8 n);
+static void fio_CloseAll();
+static void fio_EndPrint();
+static u8 *fio_GetLine();
+static u8 overlay_Ensure(LINENUM n, bool returning);
 
 FATFS fs;
 FIL f;
@@ -123,6 +382,12 @@ u8 patches_loaded = 0;
 u8 songs_loaded = 0;
 u32 songBase = 0;
 u32 songOff = 0;
+extern u32 spiram_cache_hits;
+extern u32 spiram_cache_misses;
+extern u32 spiram_cache_writebacks;
+extern u32 spibus_switches;
+extern u32 spibus_seeks;
+extern u32 spibus_continued;
 extern s8 songSpeed;
 extern bool playSong;
 extern volatile u16 songPos;
@@ -136,7 +401,50 @@ static u8 runAfterLoad = 0;
 static u8 triggerRun = 0;
 static u8 inStream = kStreamKeyboard;
 static u8 outStream = kStreamScreen;
-u8 program[RAM_SIZE];
+static u8 file_buf[STREAM_FILE_BUF_SIZE];
+static u8 file_buf_mode = FILE_BUF_IDLE;
+static u8 file_buf_pos = 0;
+static u8 file_buf_len = 0;
+static u32 file_read_left = STREAM_NO_LIMIT;//archive entries end before the file does
+static u8 serial_tx_buf[STREAM_SERIAL_BUF_SIZE];
+static u8 serial_tx_head = 0;
+static u8 serial_tx_tail = 0;
+static u32 spiram_stream_pos = 0;
+u8 program[RAM_SIZE] __attribute__((section(".noinit")));//survives a soft reset, see resume_Check()
+struct{
+	u16 magic;
+	u16 program_len;
+	LINENUM last_linenum;
+}resume_state __attribute__((section(".noinit")));
+static u8 sd_tries;
+static volatile u8 sd_retry_frames;
+static struct image_source autorun_src;
+static struct overlay_segment overlays[OVERLAY_SEGMENTS];
+static struct overlay_segment *overlay_loaded = NULL;
+static u8 overlay_count = 0;
+static u8 bank_current = 0;
+static u8 song_current = SNAPSHOT_NO_SONG;
+static u8 fcache_count = 0;
+static u8 fcache_next = 0;
+static u8 fcache_dir_count = FCACHE_DIR_UNKNOWN;
+static char pak_fname[13];
+static u16 pak_count = 0;
+static u8 unpack_where;
+static u32 unpack_pos;
+static u32 unpack_end;
+static u32 aload_left = 0;
+static u32 aload_dest;
+static u8 aload_status = ALOAD_IDLE;
+static u8 aload_frame;//steps between statements are limited to one per frame
+static u8 fio_mode[FIO_HANDLES];//0 when closed
+static u8 fio_active = FIO_NONE;//handle whose FIL is in f
+static u8 fio_stream;//handle behind kStreamHandle
+static u8 fio_print_restore = FIO_NONE;//output stream to go back to after PRINT #
+#if _USE_FASTSEEK
+static DWORD fcache_linkmap[FCACHE_MAP_SIZE];//cluster link map of the cached file open in f
+#endif
+static u16 overlay_resident_len;//program_end-program_start without any overlay
+static LINENUM overlay_resident_last;
 static u8 *txtpos,*list_line, *tmptxtpos;
 static u8 expression_error;
 static u8 expression_return_type;
@@ -153,6 +461,7 @@ static u16 current_line_no;
 #define STACK_FOR_FLAG 'F'
 static u8 table_index;
 static LINENUM linenum;
+static LINENUM last_linenum;//highest line number stored, 0 if there is no program
 
 const u16 uart_bauds[] PROGMEM = { (u16)(9600UL/10UL), (u16)(19200UL/10UL), (u16)(38400UL/10UL), (u16)(57600UL/10UL), (u16)(115200UL/10UL) }; 
 const u8 uart_divisors[] PROGMEM = { 185, 92, 46, 60, 30};
@@ -207,6 +516,22 @@ const static u8 keywords[] PROGMEM = {
 	'W','A','I','T','V'+0x80,
 	'F','A','D','E','I'+0x80,
 	'F','A','D','E','O'+0x80,
+	'B','S','A','V','E'+0x80,
+	'O','V','E','R','L','A','Y'+0x80,
+	'B','A','N','K'+0x80,
+	'S','N','A','P','S','H','O','T'+0x80,
+	'R','E','S','U','M','E'+0x80,
+	'P','A','K'+0x80,
+	'P','L','O','A','D'+0x80,
+	'A','L','O','A','D'+0x80,
+	'O','P','E','N'+0x80,
+	'C','L','O','S','E'+0x80,
+	'G','E','T'+0x80,
+	'P','U','T'+0x80,
+	'S','C','R','O','L','L'+0x80,
+	'S','M','O','O','T','H'+0x80,
+	'T','E','R','M'+0x80,
+	'D','E','F','E','R'+0x80,
 	0
 };
 
@@ -238,6 +563,22 @@ enum{//by moving the command list to an enum, we can easily remove sections abov
 	KW_BORDER, KW_PAPER, KW_INK,
 	KW_WAITV,
 	KW_FADEI, KW_FADEO,
+	KW_BSAVE,
+	KW_OVERLAY,
+	KW_BANK,
+	KW_SNAPSHOT,
+	KW_RESUME,
+	KW_PAK,
+	KW_PLOAD,
+	KW_ALOAD,
+	KW_OPEN,
+	KW_CLOSE,
+	KW_GET,
+	KW_PUT,
+	KW_SCROLL,
+	KW_SMOOTH,
+	KW_TERM,
+	KW_DEFER,
 	KW_DEFAULT /* always the final one*/
 };
 
@@ -256,7 +597,21 @@ enum{//by moving the command list to an enum, we can easily remove sections abov
 #define FUNC_URXPRT	12
 #define FUNC_UTXPRT	13
 #define FUNC_JOY	14
-#define FUNC_UNKNOWN	15
+#define FUNC_CSTAT	15
+#define FUNC_SPOS	16
+#define FUNC_ASTAT	17
+#define FUNC_UNKNOWN	18
+
+//indexed by the kStream* values, keyboard is input only and screen output only, the other direction is serial as before
+const static struct stream_driver stream_drivers[] PROGMEM = {
+	{ stream_SerialGet,		stream_SerialPut,	stream_SerialFlush },
+	{ stream_FileGet,		stream_FilePut,		stream_FileFlush },
+	{ stream_KeyboardGet,	stream_SerialPut,	stream_SerialFlush },
+	{ stream_SerialGet,		stream_ScreenPut,	stream_NullFlush },
+	{ stream_SpiRamGet,		stream_SpiRamPut,	stream_SpiRamFlush },
+	{ stream_NullGet,		stream_NullPut,		stream_NullFlush },
+	{ stream_HandleGet,		stream_HandlePut,	stream_NullFlush },
+};
 
 const static u8 func_tab[] PROGMEM = {
 'P','E','E','K'+0x80,
@@ -274,6 +629,9 @@ const static u8 func_tab[] PROGMEM = {
 'U','R','X','P','R','T'+0x80,
 'U','T','X','P','R','T'+0x80,
 'J','O','Y'+0x80,
+'C','S','T','A','T'+0x80,
+'S','P','O','S'+0x80,
+'A','S','T','A','T'+0x80,
 0
 };
 
@@ -328,12 +686,17 @@ static const char indentmsg[]		PROGMEM = "    ";
 //static const char sderrormsg[]		PROGMEM = "ERROR: Failed to initialize SD Card, read/write is disabled.";
 //static const char sdsuccessmsg[]	PROGMEM = "SUCCESS: SD is initialized";
 static const char sdfilemsg[]		PROGMEM = "ERROR: File Operation failed.";
+static const char imagemsg[]		PROGMEM = "ERROR: Bad program image.";
+static const char packmsg[]			PROGMEM = "ERROR: Bad packed data.";
+static const char spirtopmsg[]		PROGMEM = "ERROR: Past the end of user SPI RAM.";
 static const char dirextmsg[]		PROGMEM = "(dir)";
 static const char slashmsg[]		PROGMEM = "/";
 static const char spacemsg[]		PROGMEM = " ";
 
 void vsyncCallback(){
 	timer_ticks++;
+	if(sd_retry_frames)
+		sd_retry_frames--;
 	terminal_VsyncCallback();	//used to poll the keyboard
 }
 
@@ -362,6 +725,7 @@ void dump_mem(u16 start_addr,u8 rows){
 void delay(u8 ms){
 	s16 time = ms;
 	while(time > 0){
+		aload_Idle();
 		if(GetVsyncFlag()){
 			WaitVsync(1);
 			time -= 16;
@@ -477,11 +841,8 @@ static u8 print_quoted_string(){
 		i++;
 	}
 
-	while(*txtpos != delim){//print the characters
-		outchar(*txtpos);
-		txtpos++;
-	}
-	txtpos++;//skip over the last delimiter
+	outspan(txtpos, i);//print the characters
+	txtpos += i+1;//skip over the last delimiter
 	return 1;
 }
 
@@ -507,8 +868,13 @@ static void getln(char prompt){
 
 	while(1){
 		//if(GetVsyncFlag()) WaitVsync(1);
-		char c = inchar();
+		s16 c = inchar();
 		switch(c){
+		case STREAM_NOKEY://take the prompt back rather than leaving a blank line
+			if(prompt)
+				printmsgNoNL(backspacemsg);
+			txtpos[0] = NL;
+			return;
 		case NL:
 			//break;
 		case CR:
@@ -548,8 +914,7 @@ static u8 *findline(){
 }
 
 /***************************************************************************/
-static void toUppercaseBuffer(){
-	u8 *c = program_end+sizeof(LINENUM);
+static void toUppercaseBuffer(u8 *c){//up to the NL, skipping quoted strings
 	u8 quote = 0;
 
 	while(*c != NL){
@@ -574,11 +939,11 @@ void printline(){
 	//Output the line
 	printnum(line_num);
 	outchar(' ');
-	while(*list_line != NL){
-		outchar(*list_line);
-		list_line++;
-	}
-	list_line++;
+	u8 *end = list_line;
+	while(*end != NL)
+		end++;
+	outspan(list_line, end-list_line);
+	list_line = end+1;
 	line_terminator();
 }
 
@@ -643,9 +1008,11 @@ static VAR_TYPE expr4(){
 
 			case FUNC_PEEK:
 				if(params==0) goto EXPR4_ERROR;
+				if(a < 0) goto EXPR4_ERROR;
 				if(a < RAM_SIZE){
 					return program[(u16)a];
 				}else{
+					if(a >= SPIR_USER_TOP || !(run_flags & SPIR_INITIALIZED)) goto EXPR4_ERROR;
 					return SpiRamCursorRead(a);
 				}
 			case FUNC_ABS:
@@ -679,16 +1046,27 @@ static VAR_TYPE expr4(){
 			case FUNC_REDIRI:
 				if(params==0)
 				return inStream;
-				if(params < 0 || params > kStreamScreen) goto EXPR4_ERROR;
-				inStream = params;
+				if(a < 0 || a > kStreamNull) goto EXPR4_ERROR;
+				stream_SetIn(a);
 				return 1;
 
 			case FUNC_REDIRO:
 				if(params==0)
 				return outStream;
-				if(params < 0 || params > kStreamScreen) goto EXPR4_ERROR;
-				outStream = params;
+				if(a < 0 || a > kStreamNull) goto EXPR4_ERROR;
+				stream_SetOut(a);
+				return 1;
+
+			case FUNC_SPOS://position of the SPI RAM stream
+				if(params==0)
+					return spiram_stream_pos;
+				if(a < 0 || a >= SPIR_USER_TOP) goto EXPR4_ERROR;
+				spiram_stream_pos = a;
 				return 1;
+			case FUNC_ASTAT://bytes ALOAD has left, 0 when done, -1 if it failed
+				if(aload_status == ALOAD_ERROR)
+					return -1;
+				return aload_left;
 			case FUNC_UBAUD:
 				if(params==0){//get baud
 					for(u8 i=0;i<sizeof(uart_divisors);i++){
@@ -756,6 +1134,25 @@ static VAR_TYPE expr4(){
 						return 0;
 					return ReadJoypad(a);
 				}
+			case FUNC_CSTAT://SPI RAM cache and bus statistics
+				if(params==0){//reset the counters
+					spiram_cache_hits = spiram_cache_misses = spiram_cache_writebacks = 0;
+					spibus_switches = spibus_seeks = spibus_continued = 0;
+					return 1;
+				}
+				if(a == 0)
+					return spiram_cache_hits;
+				if(a == 1)
+					return spiram_cache_misses;
+				if(a == 2)
+					return spiram_cache_writebacks;
+				if(a == 3)
+					return spibus_switches;
+				if(a == 4)
+					return spibus_seeks;
+				if(a == 5)
+					return spibus_continued;
+				goto EXPR4_ERROR;
 		}
 	}
 
@@ -904,43 +1301,23 @@ int main(){
 	/////Serial.println(sentinel);
 	printmsg(initmsg);
 
-	run_flags &= ~(SD_INITIALIZED);//try 10 times to initialize else fail
-	printmsgNoNL(PSTR("Initializing SD..."));
-	for(u8 i=0;i<10;i++){
-		if(f_mount(0, &fs) != FR_OK){//if(f_mount(&fs, "", 1) != FR_OK){
-			PORTD &= ~(1<<6);//deassert card
-			WaitVsync(30);//wait
-			continue;
-		}else{
-			printmsg(PSTR("Success!"));
-			run_flags |= SD_INITIALIZED;
-			break;
-		}
-	}
-	if(!(run_flags & SD_INITIALIZED)){
-		printmsg(PSTR("ERROR"));
-	}
+	//the SD card is mounted in the background(sd_Poll()), the autorun program starts once it is ready
+	run_flags &= ~(SD_INITIALIZED);
+	run_flags |= AUTORUN_PENDING;
+	sd_tries = SD_MOUNT_TRIES;
+	sd_retry_frames = 0;
 
-	SpiRamCursorInit();
+	if(SpiRamCursorInit())
+		run_flags |= SPIR_INITIALIZED;
 	if(run_flags & SPIR_INITIALIZED){
 		printmsg(PSTR("SPI RAM Found!"));
+		terminal_SetScrollback(SCROLLBACK_LINES, scrollback_Write, scrollback_Read);
 	}
 
 	outStream = kStreamScreen;
 	inStream = kStreamKeyboard;
 	inhibitOutput = 0;
 
-	printmsgNoNL(PSTR("Searching for "));
-	printmsgNoNL(PSTR(kAutorunFilename));
-	printmsgNoNL(PSTR("..."));
-	if(f_open(&f, kAutorunFilename, FA_OPEN_EXISTING|FA_READ) == FR_OK){//try to load autorun file if present
-		printmsg(PSTR("Loaded"));
-		program_end = program_start;
-		inStream = kStreamFile;
-		inhibitOutput = 1;
-		runAfterLoad = 1;
-	}else
-		printmsg(PSTR("Not Found"));
 	u8 *start;
 	u8 *newEnd;
 	u8 linelen;
@@ -949,27 +1326,57 @@ int main(){
 	VAR_TYPE val,val2,val3;
 	u8 var;
 	char *filename;
+	struct pak_entry entry;
+	struct packed_header ph;
+	u32 spiram_addr;
+	u8 status;
 
 	program_start = program;
 	program_end = program_start;
+	last_linenum = 0;
 	sp = program+sizeof(program);	//Needed for printnum
 	stack_limit = program+sizeof(program)-STACK_SIZE;
 	variables_begin = stack_limit - 27*VAR_SIZE;
 
+	if(resume_Check()){//soft reset, program[] survived in .noinit
+		run_flags &= ~AUTORUN_PENDING;
+		printmsg(PSTR("Program kept"));
+	}else{
+		memset(program, 0, sizeof(program));//.noinit, so variables would otherwise start as garbage
+	}
+
 	//memory free
 	printnum(variables_begin-program_end);
 	printmsg(memorymsg);
 
 WARMSTART:
+	if(overlay_count)//overlays only exist while a program runs
+		overlay_Reset();
 	//this signifies that it is running in 'direct' mode.
 	current_line = 0;
 	sp = program+sizeof(program);
+	fio_EndPrint();
+	fio_CloseAll();//the last partial sector of a file being written goes to the card
+	terminal_SetDeferredWrites(false);//programs that ended with DEFER 1 don't slow the editor down
 	printmsg(okmsg);
 	promptChar = '>';
 
 PROMPT:
+	if((run_flags & (SD_INITIALIZED|AUTORUN_PENDING)) == (SD_INITIALIZED|AUTORUN_PENDING)){
+		run_flags &= ~AUTORUN_PENDING;
+		autorun_Start();
+	}
+
+	resume_state.magic = RESUME_MAGIC;//cheap enough to refresh on every line
+	resume_state.program_len = program_end-program_start;
+	resume_state.last_linenum = last_linenum;
+
 	if(triggerRun){
 		triggerRun = 0;
+		if(run_flags & AUTORUN_CACHE){//text autorun finished loading, keep an image for the next boot
+			run_flags &= ~AUTORUN_CACHE;
+			image_Save(kAutorunImageFilename, &autorun_src);
+		}
 		current_line = program_start;
 		goto EXECLINE;
 	}
@@ -980,22 +1387,8 @@ PROMPT:
 	}else{
 		getln(promptChar);
 	}
-	toUppercaseBuffer();
+	toUppercaseBuffer(program_end+sizeof(LINENUM));
 	txtpos = program_end+sizeof(u16);
-	while(*txtpos != NL)//find the end of the freshly entered line
-		txtpos++;
-
-	u8 *dest;//move it to the end of program_memory
-	dest = variables_begin-1;
-	while(1){
-		*dest = *txtpos;
-		if(txtpos == program_end+sizeof(u16))
-			break;
-		dest--;
-		txtpos--;
-	}
-	txtpos = dest;
-
 	linenum = test_int_num();//now see if we have a line number
 	ignore_blanks();
 	if(linenum == 0)
@@ -1010,6 +1403,28 @@ PROMPT:
 	linelen++;//Include the NL in the line length
 	linelen += sizeof(u16)+sizeof(char);//Add space for the line number and line length
 
+	if(linenum > last_linenum){//past the last line(always the case for a sorted LOAD), append in place
+		if(*txtpos == NL)//deleting a line that doesn't exist
+			goto PROMPT;
+		//the line number digits are at least as long as the header, so this only ever moves down
+		memmove(program_end+sizeof(LINENUM)+sizeof(char), txtpos, linelen-(sizeof(LINENUM)+sizeof(char)));
+		*((LINENUM *)program_end) = linenum;
+		program_end[sizeof(LINENUM)] = linelen;
+		program_end += linelen;
+		last_linenum = linenum;
+		goto PROMPT;
+	}
+
+	u8 *dest;//move it to the end of program_memory
+	while(*txtpos != NL)//find the end of the freshly entered line
+		txtpos++;
+	tmptxtpos = program_end+sizeof(u16);
+	dest = variables_begin-(txtpos-tmptxtpos)-1;
+	memmove(dest, tmptxtpos, (txtpos-tmptxtpos)+1);
+	txtpos = dest;
+	test_int_num();//skip the line number again
+	ignore_blanks();
+
 	//Now we have the number, add the line header.
 	txtpos -= 3;
 
@@ -1022,31 +1437,22 @@ PROMPT:
 
 	//If a line with that number exists, then remove it
 	if(start != program_end && *((LINENUM *)start) == linenum){
-		u8 *dest, *from;
-		unsigned tomove;
-
-		from = start + start[sizeof(LINENUM)];
-		dest = start;
-
-		tomove = program_end - from;
-		while(tomove > 0){
-			*dest = *from;
-			from++;
-			dest++;
-			tomove--;
-		}
-		program_end = dest;
+		u8 *from = start + start[sizeof(LINENUM)];
+		memmove(start, from, program_end - from);
+		program_end -= from - start;
 	}
 
-	if(txtpos[sizeof(LINENUM)+sizeof(char)] == NL)//If the line has no txt, it was just a delete
-		goto PROMPT_SET;
-
-
+	if(txtpos[sizeof(LINENUM)+sizeof(char)] == NL){//If the line has no txt, it was just a delete
+		if(linenum == last_linenum){//removed the last line, find the new one
+			last_linenum = 0;
+			for(u8 *line = program_start; line != program_end; line += line[sizeof(LINENUM)])
+				last_linenum = *((LINENUM *)line);
+		}
+		goto PROMPT;
+	}
 
 	//Make room for the new line, either all in one hit or lots of little shuffles
 	while(linelen > 0){
-		u16 tomove;
-		u8 *from,*dest;
 		u16 space_to_make;
 
 		space_to_make = txtpos - program_end;
@@ -1054,26 +1460,14 @@ PROMPT:
 		if(space_to_make > linelen)
 			space_to_make = linelen;
 		newEnd = program_end+space_to_make;
-		tomove = program_end - start;
 
-
-		//Source and destination - as these areas may overlap we need to move bottom up
-		from = program_end;
-		dest = newEnd;
-		while(tomove > 0){
-			from--;
-			dest--;
-			*dest = *from;
-			tomove--;
-		}
+		memmove(start+space_to_make, start, program_end - start);//these areas may overlap
 
 		//Copy over the bytes into the new space
-		for(tomove = 0; tomove < space_to_make; tomove++){
-			*start = *txtpos;
-			txtpos++;
-			start++;
-			linelen--;
-		}
+		memcpy(start, txtpos, space_to_make);
+		txtpos += space_to_make;
+		start += space_to_make;
+		linelen -= space_to_make;
 		program_end = newEnd;
 	}
 	goto PROMPT;
@@ -1083,10 +1477,12 @@ PROMPT:
 //	goto PROMPT;
 
 QHOW:
+	fio_EndPrint();//errors go to the screen, not the PRINT # file
 	printmsg(howmsg);
 	goto PROMPT;
 
 QWHAT:
+	fio_EndPrint();
 	line_terminator();
 	printmsgNoNL(whatmsg);
 	if(current_line != NULL){
@@ -1104,10 +1500,13 @@ QWHAT:
 	goto PROMPT;
 
 QSORRY:
+	fio_EndPrint();
 	printmsg(sorrymsg);
 	goto WARMSTART;
 
 RUN_NEXT_STATEMENT:
+	if(aload_left && aload_frame != (u8)timer_ticks)
+		aload_Step();
 	while(*txtpos == ':')
 		txtpos++;
 	ignore_blanks();
@@ -1122,6 +1521,7 @@ DIRECT:
 
 INTERPRET_AT_TXT_POS:
 	if(breakcheck()){
+		fio_EndPrint();
 		printf_P(PSTR("\nBreak on line %i\n"),(current_line[1]<<8)+current_line[0]);
 		goto WARMSTART;
 	}
@@ -1147,9 +1547,12 @@ INTERPRET_AT_TXT_POS:
 	case KW_NEW:
 		if(txtpos[0] != NL)
 			goto QWHAT;
+		fio_CloseAll();
 		program_end = program_start;
+		last_linenum = 0;
 		goto PROMPT;
 	case KW_RUN:
+		fio_CloseAll();
 		current_line = program_start;
 		goto EXECLINE;
 	case KW_SAVE:
@@ -1172,6 +1575,8 @@ INTERPRET_AT_TXT_POS:
 		linenum = expression();
 		if(expression_error || *txtpos != NL)
 			goto QHOW;
+		if(!overlay_Ensure(linenum, false))
+			goto QSORRY;
 		current_line = findline();
 		goto EXECLINE;
 
@@ -1249,6 +1654,38 @@ INTERPRET_AT_TXT_POS:
 		goto FADEI;
 	case KW_FADEO:
 		goto FADEO;
+	case KW_BSAVE:
+		goto BSAVE;
+	case KW_OVERLAY:
+		goto OVERLAY;
+	case KW_BANK:
+		goto BANK;
+	case KW_SNAPSHOT:
+		goto SNAPSHOT;
+	case KW_RESUME:
+		goto RESUME;
+	case KW_PAK:
+		goto PAK;
+	case KW_PLOAD:
+		goto PLOAD;
+	case KW_ALOAD:
+		goto ALOAD;
+	case KW_OPEN:
+		goto OPEN;
+	case KW_CLOSE:
+		goto CLOSE;
+	case KW_GET:
+		goto GET;
+	case KW_PUT:
+		goto PUT;
+	case KW_SCROLL:
+		goto SCROLL;
+	case KW_SMOOTH:
+		goto SMOOTH;
+	case KW_TERM:
+		goto TERM;
+	case KW_DEFER:
+		goto DEFER;
 	case KW_DEFAULT:
 		goto ASSIGNMENT;
 	default:
@@ -1261,12 +1698,45 @@ EXECNEXTLINE:
 	current_line +=	 current_line[sizeof(LINENUM)];
 
 EXECLINE:
+	if(aload_left && aload_frame != (u8)timer_ticks)//GOTO, false IF and the like skip RUN_NEXT_STATEMENT
+		aload_Step();
 	if(current_line == program_end) goto WARMSTART;//Out of lines to run
 	txtpos = current_line+sizeof(LINENUM)+sizeof(char);
 	goto INTERPRET_AT_TXT_POS;
 
 INPUT:
 		ignore_blanks();
+		if(*txtpos == '#'){//INPUT #n,V reads a line of an OPEN file, V is -1 at the end
+			txtpos++;
+			expression_error = 0;
+			val = expression();
+			if(expression_error) goto QWHAT;
+			if(!fio_Valid(val, FIO_READ)) goto QHOW;
+			ignore_blanks();
+			if(*txtpos != ',') goto QWHAT;
+			txtpos++;
+			ignore_blanks();
+			if(*txtpos < 'A' || *txtpos > 'Z') goto QWHAT;
+			var = *txtpos;
+			txtpos++;
+			ignore_blanks();
+			if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+			tmptxtpos = txtpos;
+			fio_stream = (u8)val-1;
+			val = -1;
+			if(fio_GetLine() != NULL){
+				toUppercaseBuffer(program_end+sizeof(LINENUM));
+				txtpos = program_end+sizeof(LINENUM);
+				ignore_blanks();
+				expression_error = 0;
+				val = expression();
+				if(expression_error)
+					val = 0;
+			}
+			((VAR_TYPE *)variables_begin)[var-'A'] = val;
+			txtpos = tmptxtpos;
+			goto RUN_NEXT_STATEMENT;
+		}
 		if(*txtpos < 'A' || *txtpos > 'Z') goto QWHAT;
 		var = *txtpos;
 		txtpos++;
@@ -1275,7 +1745,7 @@ INPUT:
 INPUTAGAIN:
 		tmptxtpos = txtpos;
 		getln('?');
-		toUppercaseBuffer();
+		toUppercaseBuffer(program_end+sizeof(LINENUM));
 		txtpos = program_end+sizeof(u16);
 		ignore_blanks();
 		expression_error = 0;
@@ -1346,6 +1816,8 @@ GOSUB:
 		struct stack_gosub_frame *f;
 		if(sp + sizeof(struct stack_gosub_frame) < stack_limit)
 			goto QSORRY;
+		if(!overlay_Ensure(linenum, true))
+			goto QSORRY;
 
 		sp -= sizeof(struct stack_gosub_frame);
 		f = (struct stack_gosub_frame *)sp;
@@ -1493,11 +1965,18 @@ POKE:
 	txtpos++;
 	ignore_blanks();
 	expression_error = 0;
-	val = expression();//get the value to assign
+	val2 = expression();//get the value to assign
 	if(expression_error) goto QWHAT;
 	//printf("Poke %p value %i\n",address, (u8)value);
 	//Check that we are at the end of the statement
 	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	if(val < 0) goto QHOW;
+	if(val < RAM_SIZE)
+		program[(u16)val] = val2;
+	else if(val < SPIR_USER_TOP && (run_flags & SPIR_INITIALIZED))
+		SpiRamCursorWrite(val, val2);//same address space as PEEK
+	else
+		goto QHOW;
 	goto RUN_NEXT_STATEMENT;
 
 LIST:
@@ -1514,15 +1993,28 @@ LIST:
 	goto WARMSTART;
 
 PRINT:
+	ignore_blanks();
+	if(*txtpos == '#'){//PRINT #n, the items go to an OPEN file
+		txtpos++;
+		expression_error = 0;
+		val = expression();
+		if(expression_error) goto QWHAT;
+		if(!fio_Valid(val, FIO_WRITE)) goto QHOW;
+		ignore_blanks();
+		if(*txtpos == ',')
+			txtpos++;
+		fio_stream = (u8)val-1;
+		fio_print_restore = outStream;
+		stream_SetOut(kStreamHandle);
+	}
 	//If we have an empty list then just put out a NL
 	if(*txtpos == ':'){
 		line_terminator();
 		txtpos++;
-		goto RUN_NEXT_STATEMENT;
-	}
-	if(*txtpos == NL){
-		goto EXECNEXTLINE;
+		goto PRINT_DONE;
 	}
+	if(*txtpos == NL)
+		goto PRINT_DONE;
 
 	while(1){
 		ignore_blanks();
@@ -1555,6 +2047,8 @@ PRINT:
 		}else
 			goto QWHAT;
 	}
+PRINT_DONE:
+	fio_EndPrint();
 	goto RUN_NEXT_STATEMENT;
 
 MEM:
@@ -1600,6 +2094,7 @@ DWRITE:
 	goto RUN_NEXT_STATEMENT;
 
 FILES:
+	sd_WaitReady();
 	cmd_Files();
 	goto WARMSTART;
 
@@ -1607,28 +2102,60 @@ CHAIN:
 	runAfterLoad = 1;
 
 LOAD:
+	sd_WaitReady();
 	program_end = program_start;//clear the program
+	last_linenum = 0;
 	expression_error = 0;
 	filename = filenameWord();//work out the filename
 	if(expression_error) goto QWHAT;
 
-	if(f_open(&f, (const char*)filename, FA_READ) == FR_OK){
-		inStream = kStreamFile;//this will kickstart a series of events to read in from the file.
-		inhibitOutput = 1;
+	if(fcache_Open((const char*)filename) == FR_OK){
+		stream_FileReset();
+LOAD_OPEN_FILE://f is open where the program starts
+		switch(image_Load(NULL, runAfterLoad)){
+		case IMAGE_NONE://text, replay it as typed input
+			stream_SetIn(kStreamFile);//this will kickstart a series of events to read in from the file.
+			inhibitOutput = 1;
+			break;
+		case IMAGE_LOADED:
+			f_close(&f);
+			if(runAfterLoad){
+				runAfterLoad = 0;
+				triggerRun = 1;
+			}
+			break;
+		default:
+			f_close(&f);
+			program_end = program_start;
+			last_linenum = 0;
+			runAfterLoad = 0;
+			printmsg(imagemsg);
+			break;
+		}
 	}else{
 		printmsg(sdfilemsg);
 	}
 
 	goto WARMSTART;
 
+BSAVE:
 SAVE:
+	sd_WaitReady();
 	expression_error = 0;
 	filename = filenameWord();//work out the filename
 	if(expression_error) goto QWHAT;
 
+	if(table_index == KW_BSAVE || image_IsName(filename)){
+		if(!image_Save(filename, NULL))
+			printmsg(sdfilemsg);
+		goto WARMSTART;
+	}
+
 	//open the file(overwrite if existing), switch over to file output
+	fcache_Invalidate();
 	if(f_open(&f, (const char *)filename, FA_WRITE) == FR_OK){//|FA_CREATE_ALWAYS
-		outStream = kStreamFile;
+		stream_FileReset();
+		stream_SetOut(kStreamFile);
 	}else{
 		printmsg(sdfilemsg);
 	}
@@ -1637,8 +2164,8 @@ SAVE:
 	while(list_line != program_end)
 		printline();
 
-	outStream = kStreamScreen;//go back to standard output, close the file
-	f_close(&f);
+	stream_SetOut(kStreamScreen);//go back to standard output(flushing the file), close the file
+	stream_FileClose();
 	goto WARMSTART;
 
 RSEED:
@@ -1674,6 +2201,7 @@ TONEGEN://TONE freq, duration
 	goto RUN_NEXT_STATEMENT;
 
 DLOAD:
+	sd_WaitReady();
 	expression_error = 0;
 	filename = filenameWord();//work out the filename
 		if(expression_error) goto QWHAT;
@@ -1698,7 +2226,7 @@ DLOAD:
 		ignore_blanks();
 		expression_error = 0;
 	if(dlen == 0)
-		dlen = 999999UL;
+		dlen = DLOAD_TO_EOF;
 
 	u32 roff = expression();//get starting offset in memory to write
 	if(expression_error) goto QWHAT;
@@ -1746,6 +2274,7 @@ SONG://SONG songNum
 	if(expression_error) goto QWHAT;
 	if(val >= songs_loaded) goto QSORRY;
 	StartSong((const char *)pgm_read_word(&song_table[(u8)val]));//temporary
+	song_current = val;
 	//SpiRamCursorYield();
 	//songBase = SpiRamReadU32(((uint32_t)((u8)(val)*4))>>16,((u8)(val)*4)&0xFFFF);
 	//StartSong();
@@ -1754,6 +2283,7 @@ SONG://SONG songNum
 
 NOSONG:
 	StopSong();
+	song_current = SNAPSHOT_NO_SONG;
 	goto RUN_NEXT_STATEMENT;
 
 POS:
@@ -1806,193 +2336,1546 @@ WAITV:
 	expression_error = 0;
 	val = expression();//get frames to wait
 	if(expression_error) goto QWHAT;
-	WaitVsync(val);
+	for(; val > 0; val--){
+		aload_Idle();
+		WaitVsync(1);
+	}
 	goto RUN_NEXT_STATEMENT;
 
-FADEI:
+SCROLL://SCROLL pixels[,speed] - positive scrolls up, runs on during vsync
 	expression_error = 0;
-	val = expression();//get speed
+	val = expression();//get pixels to scroll
 	if(expression_error) goto QWHAT;
+	val2 = 1;
 	ignore_blanks();
-	if(*txtpos != ',') goto QWHAT;
-	txtpos++;
-	ignore_blanks();
+	if(*txtpos == ','){
+		txtpos++;
+		val2 = expression();//get pixels per frame
+		if(expression_error) goto QWHAT;
+	}
+	if(!terminal_SmoothScroll(val, val2)) goto QHOW;
+	goto RUN_NEXT_STATEMENT;
+
+SMOOTH://SMOOTH speed - pixels per frame printed text scrolls by, 0 is off
 	expression_error = 0;
-	val2 = expression();//get blocking
+	val = expression();
 	if(expression_error) goto QWHAT;
-	FadeIn(val,val2);
+	terminal_SetSmoothScroll(val);
 	goto RUN_NEXT_STATEMENT;
 
-FADEO:
+TERM://TERM - VT100 terminal on the UART, Ctrl+] comes back
+	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	term_Run();
+	goto RUN_NEXT_STATEMENT;
+
+DEFER://DEFER 1 - screen writes wait for the next vertical blank, DEFER 0 writes them straight away
 	expression_error = 0;
-	val = expression();//get speed
+	val = expression();
+	if(expression_error) goto QWHAT;
+	if(!terminal_SetDeferredWrites(val != 0)) goto QSORRY;//not in this build
+	goto RUN_NEXT_STATEMENT;
+
+OVERLAY://OVERLAY "FILE",first line,last line
+	expression_error = 0;
+	filename = filenameWord();//work out the filename
+	if(expression_error) goto QWHAT;
+	txtpos++;//past the terminator filenameWord() left
+	ignore_blanks();
+	if(*txtpos == ',') txtpos++;
+	val = expression();//get the first line of the segment
 	if(expression_error) goto QWHAT;
 	ignore_blanks();
 	if(*txtpos != ',') goto QWHAT;
 	txtpos++;
-	ignore_blanks();
-	expression_error = 0;
-	val2 = expression();//get blocking
+	val2 = expression();//get the last line of the segment
 	if(expression_error) goto QWHAT;
-	FadeOut(val,val2);
+	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	if(overlay_count == OVERLAY_SEGMENTS) goto QSORRY;
+	if(overlay_count == 0){//everything currently in memory stays resident
+		overlay_resident_len = program_end-program_start;
+		overlay_resident_last = last_linenum;
+	}
+	if(val > val2 || val <= overlay_resident_last) goto QHOW;//must be above the resident program
+	strncpy(overlays[overlay_count].fname, filename, sizeof(overlays[0].fname)-1);
+	overlays[overlay_count].fname[sizeof(overlays[0].fname)-1] = '\0';
+	overlays[overlay_count].first = val;
+	overlays[overlay_count].last = val2;
+	overlays[overlay_count].offset = OVERLAY_UNINDEXED;
+	overlay_count++;
 	goto RUN_NEXT_STATEMENT;
 
-	return 0;
-}
-
-//returns 1 if the character is valid in a filename
-static s16 isValidFnChar(char c){
-	if(c >= '0' && c <= '9') return 1;//number
-	if(c >= 'A' && c <= 'Z') return 1;//LETTER
-	if(c >= 'a' && c <= 'z') return 1;//letter (for completeness)
-	if(c == '_') return 1;
-	if(c == '+') return 1;
-	if(c == '.') return 1;
-	if(c == '~') return 1;	//Window~1.txt
-
-	return 0;
-}
-
-char *filenameWord(){
-	//SDL - I wasn't sure if this functionality existed above, so I figured i'd put it here
-	u8 * ret = txtpos;
+BANK://BANK n, park this program(and where it is at) in SPI RAM and switch to slot n
 	expression_error = 0;
-
-	//make sure there are no quotes or spaces, search for valid characters
-	//while(*txtpos == SPACE || *txtpos == TAB || *txtpos == SQUOTE || *txtpos == DQUOTE) txtpos++;
-	while(!isValidFnChar(*txtpos)) txtpos++;
-	ret = txtpos;
-
-	if(*ret == '\0'){
-		expression_error = 1;
-		return (char *)ret;
+	val = expression();//get the slot
+	if(expression_error) goto QWHAT;
+	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	if(!(run_flags & SPIR_INITIALIZED) || val < 0 || val >= BANK_SLOTS) goto QSORRY;
+	if(overlay_loaded != NULL) goto QSORRY;
+	overlay_Reset();
+
+	bool banked_from_program = (current_line != NULL);
+	bank_Save(bank_current);
+	bank_current = val;
+	if(!bank_Load(bank_current)){//empty slot, start a new program
+		program_end = program_start;
+		last_linenum = 0;
+		memset(variables_begin, 0, IMAGE_VARS_SIZE);
+		current_line = NULL;
 	}
-
-	//now, find the next nonfnchar
-	txtpos++;
-	while(isValidFnChar(*txtpos)) txtpos++;
-	if(txtpos != ret) *txtpos = '\0';
-
-	//set the error code if we've got no string
-	if(*ret == '\0'){
-		expression_error = 1;
+	if(!banked_from_program)
+		goto WARMSTART;
+	if(current_line == NULL){//this bank wasn't running, start it from the top
+		sp = program+sizeof(program);
+		current_line = program_start;
+		goto EXECLINE;
 	}
+	goto RUN_NEXT_STATEMENT;//carry on after the BANK statement that switched away from it
 
-	return (char *)ret;
-}
-
-/***************************************************************************/
-static void line_terminator(){
-	outchar(NL);
-	outchar(CR);
-}
-
-/***********************************************************/
-static bool breakcheck(){
-
-	if(terminal_HasChar()){
-		if(terminal_GetChar()==CTRL_C){
-			return true;
-		}
+SNAPSHOT://SNAPSHOT ["FILE"], saves everything needed to RESUME right after this statement
+	ignore_blanks();
+	if(*txtpos == NL || *txtpos == ':'){//no file, keep it in SPI RAM
+		if(!(run_flags & SPIR_INITIALIZED)) goto QSORRY;
+		spiram_addr = SNAPSHOT_BASE;
+		snapshot_Save(&spiram_addr);
+		goto RUN_NEXT_STATEMENT;
+	}
+	sd_WaitReady();
+	expression_error = 0;
+	filename = filenameWord();//work out the filename
+	if(expression_error) goto QWHAT;
+	txtpos++;//past the terminator filenameWord() left
+	fcache_Invalidate();
+	if(f_open(&f, filename, FA_WRITE|FA_CREATE_ALWAYS) != FR_OK){
+		printmsg(sdfilemsg);
+		goto RUN_NEXT_STATEMENT;
 	}
+	if(!snapshot_Save(NULL))
+		printmsg(sdfilemsg);
+	f_close(&f);
+	goto RUN_NEXT_STATEMENT;
 
-	return false;
-}
-/***********************************************************/
-static s16 inchar(){
-	s16 v;
-	switch(inStream){
-	case(kStreamKeyboard):
-
-		//why blocking?
-		while(1){
-			while(!terminal_HasChar()){}
-			v=terminal_GetChar();
-			return v;
+RESUME://RESUME ["FILE"]
+	ignore_blanks();
+	if(*txtpos == NL || *txtpos == ':'){
+		if(!(run_flags & SPIR_INITIALIZED)) goto QSORRY;
+		spiram_addr = SNAPSHOT_BASE;
+		status = snapshot_Restore(&spiram_addr);
+	}else{
+		sd_WaitReady();
+		expression_error = 0;
+		filename = filenameWord();
+		if(expression_error) goto QWHAT;
+		if(fcache_Open(filename) != FR_OK){
+			printmsg(sdfilemsg);
+			goto WARMSTART;
 		}
+		status = snapshot_Restore(NULL);
+		f_close(&f);
+	}
+	if(status == IMAGE_NONE){
+		printmsg(imagemsg);
+		goto WARMSTART;
+	}
+	if(status != IMAGE_LOADED){//program[] may be half overwritten
+		program_end = program_start;
+		last_linenum = 0;
+		printmsg(imagemsg);
+		goto WARMSTART;
+	}
+	if(current_line == NULL)//taken in direct mode
+		goto WARMSTART;
+	goto RUN_NEXT_STATEMENT;
 
-		break;
-	case(kStreamFile):
-		if(GetVsyncFlag()) WaitVsync(1);
-		f_read(&f, &v, 1, &bytesRead);
-		if(bytesRead != 1){
-			f_close(&f);
-			goto INCHAR_LOADFINISH;
-		}
-		if(v == NL) v=CR;//file translate
+PAK://PAK "FILE.PAK", the archive PLOAD takes entries from
+	sd_WaitReady();
+	expression_error = 0;
+	filename = filenameWord();//work out the filename
+	if(expression_error) goto QWHAT;
+	txtpos++;//past the terminator filenameWord() left
+	if(!pak_Open(filename))
+		printmsg(sdfilemsg);
+	goto RUN_NEXT_STATEMENT;
 
+PLOAD://PLOAD "ENTRY"[,address[,where]], without an address the entry is loaded as the program
+	sd_WaitReady();
+	expression_error = 0;
+	filename = filenameWord();//work out the entry name
+	if(expression_error) goto QWHAT;
+	txtpos++;
+	ignore_blanks();
+	if(*txtpos == NL || *txtpos == ':'){
+		if(!pak_Find(filename, &entry)){
+			printmsg(sdfilemsg);
+			goto WARMSTART;
+		}
+		f_lseek(&f, entry.offset);
+		if(unpack_Probe(&ph, RAM_SIZE) != PACK_NONE){//programs are loaded in place, there's no room to unpack them
+			f_close(&f);
+			printmsg(packmsg);
+			goto WARMSTART;
+		}
+		program_end = program_start;//clear the program
+		last_linenum = 0;
+		stream_FileReset();
+		stream_FileLimit(entry.size);
+		goto LOAD_OPEN_FILE;
+	}
+	if(*txtpos != ',') goto QWHAT;
+	txtpos++;
+	expression_error = 0;
+	val = expression();//get the destination address
+	if(expression_error) goto QWHAT;
+	val2 = PAK_TO_SPIRAM;
+	ignore_blanks();
+	if(*txtpos == ','){
+		txtpos++;
+		val2 = expression();//SPI RAM or VRAM
+		if(expression_error) goto QWHAT;
+	}
+	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	if(val < 0 || (val2 == PAK_TO_VRAM && val >= VRAM_SIZE)) goto QHOW;
+	if(val2 == PAK_TO_SPIRAM && !(run_flags & SPIR_INITIALIZED)) goto QSORRY;
+	if(!pak_Find(filename, &entry)){
+		printmsg(sdfilemsg);
+		goto RUN_NEXT_STATEMENT;
+	}
+	if(val2 == PAK_TO_VRAM){//one read straight into the screen
+		terminal_FlushWrites();//or queued tiles land on top of it
+		u16 vlen = VRAM_SIZE-(u16)val;
+		f_lseek(&f, entry.offset);
+		u8 packed = unpack_Probe(&ph, vlen);
+		if(packed == PACK_TOO_BIG){
+			printmsg(packmsg);
+		}else if(packed == PACK_FOUND){
+			stream_FileReset();
+			stream_FileLimit(entry.size-sizeof(ph));
+			if(!unpack_Run(&ph, PAK_TO_VRAM, val, vlen))
+				printmsg(packmsg);
+		}else{
+			if(entry.size < vlen)
+				vlen = entry.size;
+			f_read(&f, vram+(u16)val, vlen, &bytesRead);
+		}
+		f_close(&f);
+	}else{
+		f_close(&f);
+		SpiRamCursorLoad(pak_fname, entry.offset, entry.size, val);
+	}
+	goto RUN_NEXT_STATEMENT;
+
+ALOAD://ALOAD "FILE",offset,length,address, reads into SPI RAM while the program keeps running, see ASTAT()
+	sd_WaitReady();
+	expression_error = 0;
+	filename = filenameWord();//work out the filename
+	if(expression_error) goto QWHAT;
+	txtpos++;//past the terminator filenameWord() left
+	ignore_blanks();
+	if(*txtpos != ',') goto QWHAT;
+	txtpos++;
+	val = expression();//file offset
+	if(expression_error) goto QWHAT;
+	ignore_blanks();
+	if(*txtpos != ',') goto QWHAT;
+	txtpos++;
+	val2 = expression();//length, 0 for the rest of the file
+	if(expression_error) goto QWHAT;
+	ignore_blanks();
+	if(*txtpos != ',') goto QWHAT;
+	txtpos++;
+	val3 = expression();//SPI RAM address
+	if(expression_error) goto QWHAT;
+	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	if(!(run_flags & SPIR_INITIALIZED)) goto QSORRY;
+	if(val < 0 || val2 < 0 || val3 < 0 || val3 >= SPIR_USER_TOP) goto QHOW;
+	aload_Start(filename, val, val2, val3);
+	goto RUN_NEXT_STATEMENT;
+
+OPEN://OPEN #n,"FILE"[,"R"|"W"|"A"[,preallocate bytes]]
+	sd_WaitReady();
+	ignore_blanks();
+	if(*txtpos != '#') goto QWHAT;
+	txtpos++;
+	expression_error = 0;
+	val = expression();//handle
+	if(expression_error) goto QWHAT;
+	if(val < 1 || val > FIO_HANDLES) goto QHOW;
+	ignore_blanks();
+	if(*txtpos != ',') goto QWHAT;
+	txtpos++;
+	filename = filenameWord();//work out the filename
+	if(expression_error) goto QWHAT;
+	txtpos++;//past the terminator filenameWord() left
+	ignore_blanks();
+	var = 'R';
+	val2 = 0;
+	if(*txtpos == ','){
+		txtpos++;
+		var = *filenameWord();//mode
+		if(expression_error) goto QWHAT;
+		txtpos++;
+		if(var >= 'a') var -= 'a'-'A';
+		if(var != 'R' && var != 'W' && var != 'A') goto QHOW;
+		ignore_blanks();
+		if(*txtpos == ','){
+			txtpos++;
+			val2 = expression();//bytes to preallocate
+			if(expression_error) goto QWHAT;
+		}
+	}
+	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	if(!(run_flags & SPIR_INITIALIZED)) goto QSORRY;//handles are parked in SPI RAM
+	fio_Close((u8)val-1);
+	if(!fio_Open((u8)val-1, filename, var, val2 > 0 ? val2 : 0))
+		printmsg(sdfilemsg);
+	goto RUN_NEXT_STATEMENT;
+
+CLOSE://CLOSE [#n], no handle closes them all
+	ignore_blanks();
+	if(*txtpos == NL || *txtpos == ':'){
+		fio_CloseAll();
+		goto RUN_NEXT_STATEMENT;
+	}
+	if(*txtpos != '#') goto QWHAT;
+	txtpos++;
+	expression_error = 0;
+	val = expression();
+	if(expression_error) goto QWHAT;
+	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	if(!fio_Valid(val, FIO_READ|FIO_WRITE)) goto QHOW;
+	fio_Close((u8)val-1);
+	goto RUN_NEXT_STATEMENT;
+
+GET://GET #n,V reads one byte, -1 at the end of the file
+	ignore_blanks();
+	if(*txtpos != '#') goto QWHAT;
+	txtpos++;
+	expression_error = 0;
+	val = expression();
+	if(expression_error) goto QWHAT;
+	if(!fio_Valid(val, FIO_READ)) goto QHOW;
+	ignore_blanks();
+	if(*txtpos != ',') goto QWHAT;
+	txtpos++;
+	ignore_blanks();
+	if(*txtpos < 'A' || *txtpos > 'Z') goto QWHAT;
+	var = *txtpos;
+	txtpos++;
+	ignore_blanks();
+	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	fio_stream = (u8)val-1;
+	((VAR_TYPE *)variables_begin)[var-'A'] = stream_HandleGet();
+	goto RUN_NEXT_STATEMENT;
+
+PUT://PUT #n,byte
+	ignore_blanks();
+	if(*txtpos != '#') goto QWHAT;
+	txtpos++;
+	expression_error = 0;
+	val = expression();
+	if(expression_error) goto QWHAT;
+	if(!fio_Valid(val, FIO_WRITE)) goto QHOW;
+	ignore_blanks();
+	if(*txtpos != ',') goto QWHAT;
+	txtpos++;
+	val2 = expression();
+	if(expression_error) goto QWHAT;
+	if(*txtpos != NL && *txtpos != ':') goto QWHAT;
+	fio_Use((u8)val-1);
+	var = (u8)val2;
+	f_write(&f, &var, 1, &bytesWritten);//raw, no line ending translation
+	goto RUN_NEXT_STATEMENT;
+
+FADEI:
+	expression_error = 0;
+	val = expression();//get speed
+	if(expression_error) goto QWHAT;
+	ignore_blanks();
+	if(*txtpos != ',') goto QWHAT;
+	txtpos++;
+	ignore_blanks();
+	expression_error = 0;
+	val2 = expression();//get blocking
+	if(expression_error) goto QWHAT;
+	FadeIn(val,val2);
+	goto RUN_NEXT_STATEMENT;
+
+FADEO:
+	expression_error = 0;
+	val = expression();//get speed
+	if(expression_error) goto QWHAT;
+	ignore_blanks();
+	if(*txtpos != ',') goto QWHAT;
+	txtpos++;
+	ignore_blanks();
+	expression_error = 0;
+	val2 = expression();//get blocking
+	if(expression_error) goto QWHAT;
+	FadeOut(val,val2);
+	goto RUN_NEXT_STATEMENT;
+
+	return 0;
+}
+
+//returns 1 if the character is valid in a filename
+static s16 isValidFnChar(char c){
+	if(c >= '0' && c <= '9') return 1;//number
+	if(c >= 'A' && c <= 'Z') return 1;//LETTER
+	if(c >= 'a' && c <= 'z') return 1;//letter (for completeness)
+	if(c == '_') return 1;
+	if(c == '+') return 1;
+	if(c == '.') return 1;
+	if(c == '~') return 1;	//Window~1.txt
+
+	return 0;
+}
+
+char *filenameWord(){
+	//SDL - I wasn't sure if this functionality existed above, so I figured i'd put it here
+	u8 * ret = txtpos;
+	expression_error = 0;
+
+	//make sure there are no quotes or spaces, search for valid characters
+	//while(*txtpos == SPACE || *txtpos == TAB || *txtpos == SQUOTE || *txtpos == DQUOTE) txtpos++;
+	while(!isValidFnChar(*txtpos)) txtpos++;
+	ret = txtpos;
+
+	if(*ret == '\0'){
+		expression_error = 1;
+		return (char *)ret;
+	}
+
+	//now, find the next nonfnchar
+	txtpos++;
+	while(isValidFnChar(*txtpos)) txtpos++;
+	if(txtpos != ret) *txtpos = '\0';
+
+	//set the error code if we've got no string
+	if(*ret == '\0'){
+		expression_error = 1;
+	}
+
+	return (char *)ret;
+}
+
+/***************************************************************************/
+static void line_terminator(){
+	outchar(NL);
+	outchar(CR);
+}
+
+/***********************************************************/
+static bool breakcheck(){
+	stream_SerialDrain();//keep buffered serial output moving between statements
+
+	if(terminal_HasChar()){
+		if(terminal_GetChar()==CTRL_C){
+			return true;
+		}
+	}
+
+	return false;
+}
+/***********************************************************/
+static s16 inchar(){
+	s16 v = ((s16 (*)())pgm_read_word(&stream_drivers[inStream].get))();
+	if(v != STREAM_EOF)
 		return v;
-		break;
-	 case(kStreamSerial):
-	default:
-		while(1){
-			if(GetVsyncFlag()) WaitVsync(1);
-			if(UartUnreadCount())
-				return UartReadChar();
+
+	if(inStream == kStreamFile)
+		stream_FileClose();
+	inStream = kStreamKeyboard;
+	inhibitOutput = 0;
+
+	if(runAfterLoad){
+		runAfterLoad = 0;
+		triggerRun = 1;
+	}
+	return NL;//trigger a prompt.
+}
+
+/***********************************************************/
+static void outchar(char c){
+	if(inhibitOutput) return;
+	((void (*)(char))pgm_read_word(&stream_drivers[outStream].put))(c);
+}
+
+static void outspan(const u8 *s, u16 len){//the screen takes a whole run at once
+	if(inhibitOutput) return;
+	if(outStream == kStreamScreen){
+		terminal_WriteSpan(s, len);
+		return;
+	}
+	while(len--)
+		outchar(*s++);
+}
+
+/***********************************************************/
+//Stream drivers
+static void stream_Flush(u8 s){
+	((void (*)())pgm_read_word(&stream_drivers[s].flush))();
+}
+
+static void stream_SetIn(u8 s){//input buffers are per driver, so nothing is lost by switching away
+	inStream = s;
+}
+
+static void stream_SetOut(u8 s){
+	if(s != outStream)
+		stream_Flush(outStream);
+	outStream = s;
+}
+
+static s16 stream_NullGet(){
+	return STREAM_EOF;
+}
+
+static void stream_NullPut(char c){
+}
+
+static void stream_NullFlush(){
+}
+
+static s16 stream_KeyboardGet(){
+	//why blocking?
+	while(!terminal_HasChar()){
+		if(sd_Poll())//nothing has been typed, the autorun program starts from the prompt
+			return STREAM_NOKEY;
+		aload_Idle();
+		if(GetVsyncFlag()) WaitVsync(1);
+	}
+	run_flags &= ~AUTORUN_PENDING;//typing before the card is ready cancels the autorun program
+	return terminal_GetChar();
+}
+
+static void stream_ScreenPut(char c){
+	terminal_SendChar(c);
+}
+
+static s16 stream_HandleGet(){
+	u8 c;
+	fio_Use(fio_stream);
+	f_read(&f, &c, 1, &bytesRead);
+	return bytesRead ? c : STREAM_EOF;
+}
+
+static void stream_HandlePut(char c){//FatFs only writes to the card once a sector fills
+	if(c == CR)//plain NL line endings in data files
+		return;
+	fio_Use(fio_stream);
+	f_write(&f, &c, 1, &bytesWritten);
+}
+
+static s16 stream_SerialGet(){
+	while(1){
+		stream_SerialDrain();
+		if(GetVsyncFlag()) WaitVsync(1);
+		if(UartUnreadCount())
+			return UartReadChar();
+	}
+}
+
+static void stream_SerialDrain(){//moves as much as the kernel Tx buffer will take, never blocks
+	while(serial_tx_tail != serial_tx_head && !IsUartTxBufferFull()){
+		UartSendChar(serial_tx_buf[serial_tx_tail]);
+		serial_tx_tail = (serial_tx_tail+1)&(STREAM_SERIAL_BUF_SIZE-1);
+	}
+}
+
+static void stream_SerialPut(char c){
+	u8 next = (serial_tx_head+1)&(STREAM_SERIAL_BUF_SIZE-1);
+	while(next == serial_tx_tail)//only waits once the line buffer is full
+		stream_SerialDrain();
+	serial_tx_buf[serial_tx_head] = c;
+	serial_tx_head = next;
+	stream_SerialDrain();
+}
+
+static void stream_SerialFlush(){
+	while(serial_tx_tail != serial_tx_head)
+		stream_SerialDrain();
+}
+
+static void stream_FileReset(){//call after f_open()
+	file_buf_mode = FILE_BUF_IDLE;
+	file_buf_pos = file_buf_len = 0;
+	file_read_left = STREAM_NO_LIMIT;
+}
+
+static void stream_FileLimit(u32 len){//reads stop after len more bytes
+	file_read_left = len;
+}
+
+static s16 stream_FileGet(){
+	s16 v = stream_FileGetRaw();
+	if(v == NL) v=CR;//file translate
+	return v;
+}
+
+static s16 stream_FileGetRaw(){
+	if(file_buf_mode != FILE_BUF_READ || file_buf_pos == file_buf_len){
+		stream_FileFlush();
+		if(GetVsyncFlag()) WaitVsync(1);
+		UINT want = sizeof(file_buf);
+		if(file_read_left < want)
+			want = file_read_left;
+		f_read(&f, file_buf, want, &bytesRead);
+		file_read_left -= bytesRead;
+		file_buf_mode = FILE_BUF_READ;
+		file_buf_pos = 0;
+		file_buf_len = bytesRead;
+		if(bytesRead == 0)
+			return STREAM_EOF;
+	}
+	return file_buf[file_buf_pos++];
+}
+
+static void stream_FilePut(char c){
+	if(file_buf_mode != FILE_BUF_WRITE){//any read ahead is dropped, there is only one file handle
+		file_buf_mode = FILE_BUF_WRITE;
+		file_buf_len = 0;
+	}
+	file_buf[file_buf_len++] = c;
+	if(file_buf_len == sizeof(file_buf))
+		stream_FileFlush();
+}
+
+static void stream_FileFlush(){
+	if(file_buf_mode != FILE_BUF_WRITE)
+		return;
+	if(file_buf_len)
+		f_write(&f, file_buf, file_buf_len, &bytesWritten);
+	file_buf_len = 0;
+}
+
+static void stream_FileClose(){
+	stream_FileFlush();
+	f_close(&f);
+	stream_FileReset();
+}
+
+static s16 stream_SpiRamGet(){//text stored in SPI RAM, terminated by a 0
+	if(spiram_stream_pos >= SPIR_USER_TOP)
+		return STREAM_EOF;
+	u8 v = SpiRamCursorRead(spiram_stream_pos);
+	if(v == 0)
+		return STREAM_EOF;
+	spiram_stream_pos++;
+	if(v == NL) v=CR;
+	return v;
+}
+
+static void stream_SpiRamPut(char c){
+	if(spiram_stream_pos < SPIR_USER_TOP-1)//room is kept for the terminator
+		SpiRamCursorWrite(spiram_stream_pos++, c);
+}
+
+static void stream_SpiRamFlush(){//terminate what was written so far so it can be read back
+	if(spiram_stream_pos < SPIR_USER_TOP)
+		SpiRamCursorWrite(spiram_stream_pos, 0);
+	SpiRamCursorYield();
+	SpiRamCursorUnyield();
+}
+
+/***********************************************************/
+//Binary program images: the header below, the program lines as stored in program[], then the variables
+static u16 image_Checksum(const u8 *p, u16 len, u16 sum){//Fletcher style, both halves wrap at 256
+	u8 a = sum&0xFF;
+	u8 b = sum>>8;
+	while(len--){
+		a += *p++;
+		b += a;
+	}
+	return ((u16)b<<8)|a;
+}
+
+static bool image_IsName(const char *fname){//true if the file name ends with .BIN
+	u8 len = strlen(fname);
+	if(len < 4)
+		return false;
+	fname += len-4;
+	return fname[0] == '.' && (fname[1]|0x20) == 'b' && (fname[2]|0x20) == 'i' && (fname[3]|0x20) == 'n';
+}
+
+static u8 image_Save(const char *fname, const struct image_source *src){
+	struct program_image_header h;
+	u16 plen = program_end-program_start;
+
+	h.magic[0] = IMAGE_MAGIC0;
+	h.magic[1] = IMAGE_MAGIC1;
+	h.version = IMAGE_VERSION;
+	h.var_size = VAR_SIZE;
+	h.ram_size = RAM_SIZE;
+	h.program_len = plen;
+	h.last_linenum = last_linenum;
+	if(src)
+		h.src = *src;
+	else
+		memset(&h.src, 0, sizeof(h.src));
+	h.checksum = image_Checksum(variables_begin, IMAGE_VARS_SIZE, image_Checksum(program_start, plen, 0));
+
+	fcache_Invalidate();
+	if(f_open(&f, fname, FA_WRITE|FA_CREATE_ALWAYS) != FR_OK)
+		return 0;
+	u8 ok = f_write(&f, &h, sizeof(h), &bytesWritten) == FR_OK && bytesWritten == sizeof(h) &&
+		f_write(&f, program_start, plen, &bytesWritten) == FR_OK && bytesWritten == plen &&
+		f_write(&f, variables_begin, IMAGE_VARS_SIZE, &bytesWritten) == FR_OK && bytesWritten == IMAGE_VARS_SIZE;
+	if(f_close(&f) != FR_OK)
+		ok = 0;
+	return ok;
+}
+
+static u8 image_Load(const struct image_source *src, bool keep_vars){//f must be open where the program starts, a text program is left there
+	struct program_image_header h;
+	u32 start = f_tell(&f);
+
+	f_read(&f, &h, sizeof(h), &bytesRead);
+	if(bytesRead != sizeof(h) || h.magic[0] != IMAGE_MAGIC0 || h.magic[1] != IMAGE_MAGIC1){
+		f_lseek(&f, start);
+		return IMAGE_NONE;
+	}
+	if(h.version != IMAGE_VERSION || h.var_size != VAR_SIZE || h.ram_size != RAM_SIZE || h.program_len > variables_begin-program_start)
+		return IMAGE_BAD;
+	if(src && memcmp(&h.src, src, sizeof(h.src)))//built from a different version of the source
+		return IMAGE_STALE;
+
+	f_read(&f, program_start, h.program_len, &bytesRead);//the whole program in one read
+	if(bytesRead != h.program_len)
+		return IMAGE_BAD;
+	u16 sum = image_Checksum(program_start, h.program_len, 0);
+	if(keep_vars){//CHAIN passes the caller's variables on, the saved ones are only checked
+		u8 tmp[16];
+		for(u16 left = IMAGE_VARS_SIZE; left; left -= bytesRead){
+			f_read(&f, tmp, (left < sizeof(tmp)) ? left : sizeof(tmp), &bytesRead);
+			if(bytesRead == 0)
+				return IMAGE_BAD;
+			sum = image_Checksum(tmp, bytesRead, sum);
+		}
+	}else{
+		f_read(&f, variables_begin, IMAGE_VARS_SIZE, &bytesRead);
+		if(bytesRead != IMAGE_VARS_SIZE)
+			return IMAGE_BAD;
+		sum = image_Checksum(variables_begin, IMAGE_VARS_SIZE, sum);
+	}
+	if(sum != h.checksum)
+		return IMAGE_BAD;
+
+	program_end = program_start+h.program_len;
+	last_linenum = h.last_linenum;
+	return IMAGE_LOADED;
+}
+
+/***********************************************************/
+static u8 sd_Poll(){//mounts the card in the background, returns 1 if the autorun program is waiting to start
+	if((run_flags & SD_INITIALIZED) || sd_tries == 0 || sd_retry_frames)
+		return 0;
+	if(f_mount(0, &fs) != FR_OK){//if(f_mount(&fs, "", 1) != FR_OK){
+		PORTD &= ~(1<<6);//deassert card
+		sd_tries--;
+		sd_retry_frames = SD_RETRY_FRAMES;//counted down by vsyncCallback()
+		return 0;
+	}
+	run_flags |= SD_INITIALIZED;
+	fcache_Invalidate();
+	return (run_flags & AUTORUN_PENDING) != 0;
+}
+
+static void sd_WaitReady(){//for commands that need the card right away
+	run_flags &= ~AUTORUN_PENDING;//the user got in before the autorun program
+	fio_Claim();//f is ours from here
+	while(!(run_flags & SD_INITIALIZED) && sd_tries){
+		sd_Poll();
+		if(!(run_flags & SD_INITIALIZED))
+			WaitVsync(1);
+	}
+}
+
+static u8 autorun_Start(){//prefers the cached image if it was built from the current kAutorunFilename
+	FILINFO info;
+	bool have_src = (fcache_Stat(kAutorunFilename, &info) == FR_OK);
+
+	if(have_src){
+		autorun_src.size = info.fsize;
+		autorun_src.date = info.fdate;
+		autorun_src.time = info.ftime;
+	}
+
+	if(fcache_Open(kAutorunImageFilename) == FR_OK){
+		u8 r = image_Load(have_src ? &autorun_src : NULL, false);
+		f_close(&f);
+		if(r == IMAGE_LOADED){
+			triggerRun = 1;
+			return 1;
+		}
+	}
+
+	if(!have_src || fcache_Open(kAutorunFilename) != FR_OK)
+		return 0;
+	program_end = program_start;
+	last_linenum = 0;
+	stream_FileReset();
+	stream_SetIn(kStreamFile);
+	inhibitOutput = 1;
+	runAfterLoad = 1;
+	run_flags |= AUTORUN_CACHE;
+	return 1;
+}
+
+static bool resume_Check(){//picks up a program left in program[] by a soft reset, if it is intact
+	if(resume_state.magic != RESUME_MAGIC || resume_state.program_len > variables_begin-program_start)
+		return false;
+
+	u8 *line = program_start;
+	u8 *end = program_start+resume_state.program_len;
+	LINENUM prev = 0;
+	while(line < end){//every line must be in order, fit, and be NL terminated
+		u8 len = line[sizeof(LINENUM)];
+		if(*((LINENUM *)line) <= prev || len <= sizeof(LINENUM)+sizeof(char) || line+len > end || line[len-1] != NL)
+			return false;
+		prev = *((LINENUM *)line);
+		line += len;
+	}
+	if(prev != resume_state.last_linenum)
+		return false;
+
+	program_end = end;
+	last_linenum = prev;
+	return true;
+}
+
+/***********************************************************/
+//Overlays: line ranges that live in a file and are loaded on demand above the resident program
+static void overlay_Reset(){//drops the loaded overlay and all declarations
+	if(overlay_loaded != NULL){
+		program_end = program_start+overlay_resident_len;
+		last_linenum = overlay_resident_last;
+	}
+	overlay_loaded = NULL;
+	overlay_count = 0;
+}
+
+static void overlay_Index(const char *fname, LINENUM n, u32 off){//remember where segments of this file start
+	for(u8 i=0;i<overlay_count;i++){
+		struct overlay_segment *seg = &overlays[i];
+		if(seg->offset == OVERLAY_UNINDEXED && n >= seg->first && n <= seg->last && !strcmp(seg->fname, fname))
+			seg->offset = off;
+	}
+}
+
+static u8 overlay_Load(struct overlay_segment *seg){
+	u8 *saved_txtpos = txtpos;
+	u8 ret = 0;
+
+	if(inStream == kStreamFile || outStream == kStreamFile)//the file handle is busy
+		return 0;
+	sd_WaitReady();
+	if(fcache_Open(seg->fname) != FR_OK)
+		return 0;
+	stream_FileReset();
+	if(seg->offset != OVERLAY_UNINDEXED && f_lseek(&f, seg->offset) != FR_OK)
+		goto OVERLAY_LOAD_FINISH;
+
+	program_end = program_start+overlay_resident_len;//replace the previous overlay
+	last_linenum = overlay_resident_last;
+	overlay_loaded = NULL;
+
+	while(1){
+		u32 off = f.fptr-(file_buf_len-file_buf_pos);//file offset of this line
+		u8 *text = program_end+sizeof(LINENUM)+sizeof(char);
+		u8 *p = text;
+		s16 c;
+
+		while((c = stream_FileGet()) != STREAM_EOF && c != CR){
+			if(p >= variables_begin-1)//out of memory
+				goto OVERLAY_LOAD_FINISH;
+			*p++ = c;
+		}
+		*p = NL;
+
+		txtpos = text;
+		LINENUM n = test_int_num();
+		if(n != 0){
+			overlay_Index(seg->fname, n, off);
+			if(n > seg->last)
+				break;
+			if(n >= seg->first){
+				if(n <= last_linenum)//out of order
+					goto OVERLAY_LOAD_FINISH;
+				ignore_blanks();
+				toUppercaseBuffer(txtpos);
+				u8 linelen = (p-txtpos)+1+sizeof(LINENUM)+sizeof(char);
+				memmove(text, txtpos, (p-txtpos)+1);
+				*((LINENUM *)program_end) = n;
+				program_end[sizeof(LINENUM)] = linelen;
+				program_end += linelen;
+				last_linenum = n;
+			}
+		}
+		if(c == STREAM_EOF)
+			break;
+	}
+	overlay_loaded = seg;
+	ret = 1;
+
+OVERLAY_LOAD_FINISH:
+	if(!ret){//drop whatever part of the segment made it in
+		program_end = program_start+overlay_resident_len;
+		last_linenum = overlay_resident_last;
+		overlay_loaded = NULL;
+	}
+	f_close(&f);
+	stream_FileReset();
+	txtpos = saved_txtpos;
+	return ret;
+}
+
+static bool overlay_Holds(u8 *line, u8 *pos){//true if a saved position is inside the loaded overlay
+	u8 *overlay = program_start+overlay_resident_len;
+	return line != NULL && (line >= overlay || pos >= overlay);
+}
+
+static u8 overlay_Ensure(LINENUM n, bool returning){//makes sure line n is in memory, 0 if it can't be
+	struct overlay_segment *seg = NULL;
+
+	for(u8 i=0;i<overlay_count;i++){
+		if(n >= overlays[i].first && n <= overlays[i].last){
+			seg = &overlays[i];
+			break;
+		}
+	}
+	if(seg == NULL || seg == overlay_loaded)
+		return 1;
+	if(returning && overlay_Holds(current_line, txtpos))//the return point would be overwritten
+		return 0;
+
+	u8 *p = sp;//so would any GOSUB or FOR still waiting to come back into it
+	while(p < program+sizeof(program)-1){
+		if(*p == STACK_GOSUB_FLAG){
+			struct stack_gosub_frame *g = (struct stack_gosub_frame *)p;
+			if(overlay_Holds(g->current_line, g->txtpos))
+				return 0;
+			p += sizeof(struct stack_gosub_frame);
+		}else if(*p == STACK_FOR_FLAG){
+			struct stack_for_frame *fr = (struct stack_for_frame *)p;
+			if(overlay_Holds(fr->current_line, fr->txt_pos))
+				return 0;
+			p += sizeof(struct stack_for_frame);
+		}else{
+			break;
+		}
+	}
+	return overlay_Load(seg);
+}
+
+/***********************************************************/
+//Program banks: each slot holds a bank_header, then program[] laid out as in memory(minus the free gap)
+static void bank_Save(u8 n){
+	struct bank_header h;
+	u32 addr = BANK_BASE+(u32)n*BANK_SLOT_SIZE;
+	u16 plen = program_end-program_start;
+	u16 tail = (program+sizeof(program))-variables_begin;//variables and the stack
+
+	h.magic = BANK_MAGIC;
+	h.program_len = plen;
+	h.last_linenum = last_linenum;
+	h.sp = sp;
+	h.current_line = current_line;
+	h.txtpos = txtpos;
+	h.checksum = image_Checksum(variables_begin, tail, image_Checksum(program_start, plen, 0));
+
+	SpiRamBlockWrite(addr, &h, sizeof(h));
+	SpiRamBlockWrite(addr+sizeof(h), program_start, plen);
+	SpiRamBlockWrite(addr+sizeof(h)+(variables_begin-program), variables_begin, tail);
+}
+
+static u8 bank_Load(u8 n){//0 if the slot doesn't hold a program
+	struct bank_header h;
+	u32 addr = BANK_BASE+(u32)n*BANK_SLOT_SIZE;
+	u16 tail = (program+sizeof(program))-variables_begin;
+
+	SpiRamBlockRead(addr, &h, sizeof(h));
+	if(h.magic != BANK_MAGIC || h.program_len > variables_begin-program_start)
+		return 0;
+	SpiRamBlockRead(addr+sizeof(h), program_start, h.program_len);
+	SpiRamBlockRead(addr+sizeof(h)+(variables_begin-program), variables_begin, tail);
+	if(image_Checksum(variables_begin, tail, image_Checksum(program_start, h.program_len, 0)) != h.checksum)
+		return 0;
+
+	program_end = program_start+h.program_len;
+	last_linenum = h.last_linenum;
+	sp = h.sp;
+	current_line = h.current_line;
+	txtpos = h.txtpos;
+	return 1;
+}
+
+/***********************************************************/
+//Snapshots: a snapshot_header, then all of program[] and vram, written and read back in one pass
+static u8 snapshot_Put(u32 *addr, const void *src, u16 len){//to the open file f, or SPI RAM at *addr
+	if(addr == NULL){
+		f_write(&f, src, len, &bytesWritten);
+		return bytesWritten == len;
+	}
+	SpiRamBlockWrite(*addr, src, len);
+	*addr += len;
+	return 1;
+}
+
+static u8 snapshot_Get(u32 *addr, void *dst, u16 len){
+	if(addr == NULL){
+		f_read(&f, dst, len, &bytesRead);
+		return bytesRead == len;
+	}
+	SpiRamBlockRead(*addr, dst, len);
+	*addr += len;
+	return 1;
+}
+
+static u8 snapshot_Save(u32 *addr){
+	struct snapshot_header h;
+
+	h.magic = SNAPSHOT_MAGIC;
+	h.version = SNAPSHOT_VERSION;
+	h.ram_size = RAM_SIZE;
+	h.vram_size = VRAM_SIZE;
+	h.program_len = program_end-program_start;
+	h.last_linenum = last_linenum;
+	h.sp = sp;
+	h.current_line = current_line;
+	h.txtpos = txtpos;
+	terminal_GetState(&h.term);
+	h.song = playSong ? song_current : SNAPSHOT_NO_SONG;
+	h.song_pos = songPos;
+	h.song_base = songBase;
+	h.song_off = songOff;
+	h.bank = bank_current;
+	h.checksum = image_Checksum(vram, VRAM_SIZE, image_Checksum(program, RAM_SIZE, 0));
+
+	return snapshot_Put(addr, &h, sizeof(h)) && snapshot_Put(addr, program, RAM_SIZE) && snapshot_Put(addr, vram, VRAM_SIZE);
+}
+
+static u8 snapshot_Restore(u32 *addr){//program[] is only trashed once the header checks out
+	struct snapshot_header h;
+
+	if(!snapshot_Get(addr, &h, sizeof(h)) || h.magic != SNAPSHOT_MAGIC)
+		return IMAGE_NONE;
+	if(h.version != SNAPSHOT_VERSION || h.ram_size != RAM_SIZE || h.vram_size != VRAM_SIZE || h.program_len > variables_begin-program_start)
+		return IMAGE_BAD;
+	terminal_FlushWrites();
+	if(!snapshot_Get(addr, program, RAM_SIZE) || !snapshot_Get(addr, vram, VRAM_SIZE))
+		return IMAGE_BAD;
+	if(image_Checksum(vram, VRAM_SIZE, image_Checksum(program, RAM_SIZE, 0)) != h.checksum)
+		return IMAGE_BAD;
+
+	program_end = program_start+h.program_len;
+	last_linenum = h.last_linenum;
+	sp = h.sp;
+	current_line = h.current_line;
+	txtpos = h.txtpos;
+	bank_current = h.bank;
+	terminal_SetState(&h.term);
+	StopSong();
+	song_current = h.song;
+	if(h.song < songs_loaded){//picks up at the next event after the saved position
+		StartSong((const char *)pgm_read_word(&song_table[h.song]));
+		songPos = h.song_pos;
+	}
+	songBase = h.song_base;
+	songOff = h.song_off;
+	return IMAGE_LOADED;
+}
+
+/***********************************************************/
+//File cache: the root directory listing and the FIL of recently opened files, kept in SPI RAM
+static void fcache_Invalidate(){//after anything that writes to the card
+	fio_Claim();
+	fcache_count = 0;
+	fcache_next = 0;
+	fcache_dir_count = FCACHE_DIR_UNKNOWN;
+}
+
+static bool fcache_Cacheable(const char *fname){//only plain names in the root directory
+	return (run_flags & SPIR_INITIALIZED) && strlen(fname) < 13 && strchr(fname, '/') == NULL;
+}
+
+static bool fcache_DirFind(const char *fname, FILINFO *info){//fcache_dir_count must be known
+	for(u8 i=0; i<fcache_dir_count; i++){
+		SpiRamBlockRead(FCACHE_DIR_BASE+(u32)i*sizeof(FILINFO), info, sizeof(FILINFO));
+		if(!strcasecmp(info->fname, fname))
+			return true;
+	}
+	return false;
+}
+
+static FRESULT fcache_Stat(const char *fname, FILINFO *info){
+	if(fcache_dir_count == FCACHE_DIR_UNKNOWN || !fcache_Cacheable(fname))
+		return f_stat(fname, info);
+	return fcache_DirFind(fname, info) ? FR_OK : FR_NO_FILE;
+}
+
+static FRESULT fcache_Open(const char *fname){//f_open(&f, fname, FA_READ) without the directory scan once a file has been seen
+	char name[13];
+	u32 addr;
+	u8 i;
+
+	fio_Claim();//shares f
+	if(!fcache_Cacheable(fname))
+		return f_open(&f, fname, FA_READ);
+
+	for(i=0; i<fcache_count; i++){
+		addr = FCACHE_FILE_BASE+(u32)i*sizeof(struct fcache_file);
+		SpiRamBlockRead(addr, name, sizeof(name));
+		if(strcasecmp(name, fname))
+			continue;
+		SpiRamBlockRead(addr+offsetof(struct fcache_file, fil), &f, sizeof(FIL));//as f_open() left it
+#if _USE_FASTSEEK
+		SpiRamBlockRead(addr+offsetof(struct fcache_file, linkmap), fcache_linkmap, sizeof(fcache_linkmap));
+		f.cltbl = fcache_linkmap[0] ? fcache_linkmap : NULL;
+#endif
+		return FR_OK;
+	}
+
+	if(fcache_dir_count != FCACHE_DIR_UNKNOWN){//the listing is known, don't go looking for files that aren't there
+		FILINFO info;
+		if(!fcache_DirFind(fname, &info))
+			return FR_NO_FILE;
+	}
+
+	FRESULT res = f_open(&f, fname, FA_READ);
+	if(res != FR_OK)
+		return res;
+
+	addr = FCACHE_FILE_BASE+(u32)fcache_next*sizeof(struct fcache_file);
+	if(++fcache_next == FCACHE_FILES)//oldest goes first
+		fcache_next = 0;
+	if(fcache_count < FCACHE_FILES)
+		fcache_count++;
+	strcpy(name, fname);
+	SpiRamBlockWrite(addr, name, sizeof(name));
+	SpiRamBlockWrite(addr+offsetof(struct fcache_file, fil), &f, sizeof(FIL));
+#if _USE_FASTSEEK
+	fcache_linkmap[0] = FCACHE_MAP_SIZE;//walk the cluster chain once, later seeks don't touch the FAT
+	f.cltbl = fcache_linkmap;
+	if(f_lseek(&f, CREATE_LINKMAP) != FR_OK){//too fragmented for the table, seek the slow way
+		fcache_linkmap[0] = 0;
+		f.cltbl = NULL;
+	}
+	SpiRamBlockWrite(addr+offsetof(struct fcache_file, linkmap), fcache_linkmap, sizeof(fcache_linkmap));
+#endif
+	return FR_OK;
+}
+
+static void files_Print(const FILINFO *entry){
+	//common header
+	printmsgNoNL(indentmsg);
+	printmsgNoNL((const char *)entry->fname);
+	if(entry->fattrib & AM_DIR){
+		printmsgNoNL(slashmsg);
+		u8 found_end = 0;
+		for(u8 i=0; i<13 ; i++){
+			if(entry->fname[i] == '\0')
+				found_end = 1;
+			if(found_end)
+				printmsgNoNL(spacemsg);
+		}
+		printmsgNoNL(dirextmsg);
+	}else{//file ending
+		u8 found_end = 0;
+		for(u8 i=0; i<13 ; i++){
+			if(entry->fname[i] == '\0')
+				found_end = 1;
+			if(found_end)
+				printmsgNoNL(spacemsg);
 		}
+		printnum(entry->fsize);
 	}
+	line_terminator();
+}
 
-INCHAR_LOADFINISH:
-	inStream = kStreamKeyboard;
-	inhibitOutput = 0;
+/***********************************************************/
+//Asset archives built by tools/uzepak: a header, an index sorted by name, then the payloads
+static bool pak_Open(const char *fname){//selects the archive PLOAD reads from
+	struct pak_header h;
+
+	pak_count = 0;
+	if(strlen(fname) >= sizeof(pak_fname) || fcache_Open(fname) != FR_OK)
+		return false;
+	f_read(&f, &h, sizeof(h), &bytesRead);
+	f_close(&f);
+	if(bytesRead != sizeof(h) || memcmp(h.magic, "UZPK", 4) || h.version != PAK_VERSION)
+		return false;
+	strcpy(pak_fname, fname);
+	pak_count = h.count;
+	return true;
+}
 
-	if(runAfterLoad){
-		runAfterLoad = 0;
-		triggerRun = 1;
+static bool pak_Find(const char *name, struct pak_entry *e){//binary search of the index, leaves the archive open in f if found
+	char key[PAK_NAME_LEN];
+	u16 lo = 0, hi = pak_count;
+
+	if(pak_count == 0 || strlen(name) >= PAK_NAME_LEN)
+		return false;
+	memset(key, 0, sizeof(key));//names are stored upper case and zero padded
+	for(u8 i=0; name[i]; i++)
+		key[i] = (name[i] >= 'a' && name[i] <= 'z') ? name[i]-('a'-'A') : name[i];
+	if(fcache_Open(pak_fname) != FR_OK)
+		return false;
+
+	while(lo < hi){
+		u16 mid = (lo+hi)/2;
+		f_lseek(&f, sizeof(struct pak_header)+(u32)mid*sizeof(struct pak_entry));
+		f_read(&f, e, sizeof(struct pak_entry), &bytesRead);
+		if(bytesRead != sizeof(struct pak_entry))
+			break;
+		int c = strncmp(key, e->name, PAK_NAME_LEN);
+		if(c == 0)
+			return true;
+		if(c < 0)
+			hi = mid;
+		else
+			lo = mid+1;
 	}
-	return NL;//trigger a prompt.
+	f_close(&f);
+	return false;
 }
 
 /***********************************************************/
-static void outchar(char c){
-	if(inhibitOutput) return;
+//Packed data from tools/uzepak, unpacked while it streams in with the destination as the window
+static u8 unpack_Probe(struct packed_header *h, u32 room){//f is left after the header if it is there, where it was otherwise
+	u32 start = f_tell(&f);
+	f_read(&f, h, sizeof(struct packed_header), &bytesRead);
+	if(bytesRead == sizeof(struct packed_header) && h->magic[0] == PACK_MAGIC0 && h->magic[1] == PACK_MAGIC1 &&
+	(h->method == PACK_RLE || h->method == PACK_LZ4))
+		return (h->size <= room) ? PACK_FOUND : PACK_TOO_BIG;//rather than spill past the destination
+	f_lseek(&f, start);
+	return PACK_NONE;
+}
 
-	if(outStream == kStreamScreen){
-		//ConsolePrintChar(c);
-		terminal_SendChar(c);
-	}else if(outStream == kStreamFile){
-		f_write(&f, &c, 1, &bytesWritten);
+static void unpack_Put(u8 v){
+	if(unpack_pos < unpack_end){//clipped to the room the caller gave
+		if(unpack_where == PAK_TO_VRAM)
+			vram[(u16)unpack_pos] = v;
+		else
+			SpiRamCursorWrite(unpack_pos, v);
+	}
+	unpack_pos++;
+}
+
+static u8 unpack_Back(u16 dist){//a byte already unpacked
+	u32 addr = unpack_pos-dist;
+	if(addr >= unpack_end)
+		return 0;
+	return (unpack_where == PAK_TO_VRAM) ? vram[(u16)addr] : SpiRamCursorRead(addr);
+}
+
+static bool unpack_Length(u32 *n){//LZ4 lengths of 15 carry on in the following bytes, false at the end of the file
+	s16 b;
+	if(*n != 15)
+		return true;
+	do{
+		b = stream_FileGetRaw();
+		if(b == STREAM_EOF)
+			return false;
+		*n += b;
+	}while(b == 255);
+	return true;
+}
+
+static u8 unpack_Run(const struct packed_header *h, u8 where, u32 dest, u32 room){//reads through the file stream, 0 if the data is bad
+	u32 end = dest+h->size;
+	s16 c, b;
+
+	unpack_where = where;
+	unpack_pos = dest;
+	unpack_end = (h->size < room) ? end : dest+room;
+
+	while(unpack_pos < end){
+		if(GetVsyncFlag()) WaitVsync(1);
+		c = stream_FileGetRaw();
+		if(c == STREAM_EOF)
+			return 0;
+		if(h->method == PACK_RLE){
+			if(c < 128){//c+1 literals
+				for(c++; c; c--){
+					if((b = stream_FileGetRaw()) == STREAM_EOF)
+						return 0;
+					unpack_Put(b);
+				}
+			}else{//a run of c-125
+				if((b = stream_FileGetRaw()) == STREAM_EOF)
+					return 0;
+				for(c -= 125; c; c--)
+					unpack_Put(b);
+			}
+			continue;
+		}
+
+		u32 len = c>>4;//LZ4 sequence: literals, then a match
+		if(!unpack_Length(&len))
+			return 0;
+		for(; len; len--){
+			if((b = stream_FileGetRaw()) == STREAM_EOF)
+				return 0;
+			unpack_Put(b);
+		}
+		if(unpack_pos >= end)//the last sequence has no match
+			break;
+		if((b = stream_FileGetRaw()) == STREAM_EOF)
+			return 0;
+		u16 dist = b;
+		if((b = stream_FileGetRaw()) == STREAM_EOF)
+			return 0;
+		dist |= (u16)b<<8;
+		if(dist == 0 || dist > unpack_pos-dest)
+			return 0;
+		len = c&15;
+		if(!unpack_Length(&len))
+			return 0;
+		for(len += 4; len; len--)
+			unpack_Put(unpack_Back(dist));
+	}
+	return unpack_pos == end;
+}
+
+/***********************************************************/
+//Background loads: f stays open for ALOAD until it finishes, anything else that wants the card finishes it first
+static u8 aload_Start(const char *fname, u32 foff, u32 len, u32 dest){
+	aload_Finish();
+	aload_status = ALOAD_ERROR;
+	if(fcache_Open(fname) != FR_OK)
+		return 0;
+	if(foff > f_size(&f) || f_lseek(&f, foff) != FR_OK){
+		f_close(&f);
+		return 0;
+	}
+	if(len == 0 || len > f_size(&f)-foff)//0 is the rest of the file
+		len = f_size(&f)-foff;
+	if(dest >= SPIR_USER_TOP || len > SPIR_USER_TOP-dest){
+		f_close(&f);
+		return 0;
+	}
+	aload_left = len;
+	aload_dest = dest;
+	aload_status = ALOAD_BUSY;
+	if(aload_left == 0)
+		aload_Step();//nothing to read, just close
+	return 1;
+}
+
+static void aload_Step(){//up to the end of the current sector, so one card read at most
+	u8 buf[32];
+	u16 n = SD_SECTOR_SIZE-(u16)(f.fptr&(SD_SECTOR_SIZE-1));
+
+	aload_frame = (u8)timer_ticks;
+	if(n > aload_left)
+		n = aload_left;
+	while(n){
+		u8 chunk = (n < sizeof(buf)) ? n : sizeof(buf);
+		f_read(&f, buf, chunk, &bytesRead);
+		SpiRamBlockWrite(aload_dest, buf, bytesRead);//around the cache, a write miss would read the line in first
+		aload_dest += bytesRead;
+		aload_left -= bytesRead;
+		if(bytesRead != chunk){//file shrank under us
+			aload_left = 0;
+			aload_status = ALOAD_ERROR;
+			break;
+		}
+		n -= chunk;
+	}
+	if(aload_left == 0){
+		f_close(&f);
+		if(aload_status == ALOAD_BUSY)
+			aload_status = ALOAD_DONE;
+	}
+}
+
+static void aload_Idle(){//spare time until the next vsync
+	while(aload_left && !GetVsyncFlag())
+		aload_Step();
+}
+
+static void aload_Finish(){
+	while(aload_left)
+		aload_Step();
+}
+
+/***********************************************************/
+//BASIC file handles. There's room for one FIL(and its sector buffer) in RAM, so each handle's
+//FIL is parked in SPI RAM and swapped into f when it's used, FatFs does the sector buffering.
+static void fio_Park(){
+	if(fio_active == FIO_NONE)
+		return;
+	SpiRamBlockWrite(FIO_BASE+(u32)fio_active*sizeof(FIL), &f, sizeof(FIL));
+	fio_active = FIO_NONE;
+}
+
+static void fio_Claim(){//f is wanted for something else
+	aload_Finish();
+	fio_Park();
+}
+
+static void fio_Use(u8 n){
+	if(fio_active == n)
+		return;
+	fio_Claim();
+	SpiRamBlockRead(FIO_BASE+(u32)n*sizeof(FIL), &f, sizeof(FIL));
+	fio_active = n;
+}
+
+static bool fio_Valid(VAR_TYPE n, u8 mode){
+	return n >= 1 && n <= FIO_HANDLES && (fio_mode[(u8)n-1] & mode);
+}
+
+static u8 fio_Open(u8 n, const char *fname, char mode, u32 prealloc){//n counts from 0
+	fio_Claim();
+	if(mode == 'R'){
+		if(f_open(&f, fname, FA_READ) != FR_OK)
+			return 0;
+		fio_mode[n] = FIO_READ;
 	}else{
-		while(IsUartTxBufferFull());
-		UartSendChar(c);
+		fcache_Invalidate();
+		if(f_open(&f, fname, FA_WRITE|(mode == 'A' ? FA_OPEN_ALWAYS : FA_CREATE_ALWAYS)) != FR_OK)
+			return 0;
+		u32 pos = f_size(&f);//appending starts at the end
+		fio_mode[n] = FIO_WRITE;
+		if(prealloc && f_lseek(&f, pos+prealloc) == FR_OK)//allocate the clusters now so logging doesn't stop for the FAT
+			fio_mode[n] |= FIO_TRUNCATE;
+		f_lseek(&f, pos);
+	}
+	fio_active = n;
+	return 1;
+}
+
+static void fio_Close(u8 n){
+	u8 mode = fio_mode[n];
+	if(!mode)
+		return;
+	fio_Use(n);
+	if(mode & FIO_TRUNCATE)//drop what was preallocated and not written
+		f_truncate(&f);
+	f_close(&f);
+	fio_mode[n] = 0;
+	fio_active = FIO_NONE;
+	if(mode & FIO_WRITE)//the size and directory entry changed
+		fcache_Invalidate();
+}
+
+static void fio_CloseAll(){
+	for(u8 i=0; i<FIO_HANDLES; i++)
+		fio_Close(i);
+}
+
+static void fio_EndPrint(){//PRINT # is done(or failed), back to the previous output
+	if(fio_print_restore == FIO_NONE)
+		return;
+	stream_SetOut(fio_print_restore);
+	fio_print_restore = FIO_NONE;
+}
+
+static u8 *fio_GetLine(){//INPUT # reads a line into the direct mode buffer, NULL at the end of the file
+	u8 *p = program_end+sizeof(LINENUM);
+	s16 c;
+	do{//skip the line endings left by the previous line
+		c = stream_HandleGet();
+	}while(c == NL || c == CR);
+	if(c == STREAM_EOF)
+		return NULL;
+	while(c != STREAM_EOF && c != NL && c != CR){
+		if(p < variables_begin-2)
+			*p++ = c;
+		c = stream_HandleGet();
+	}
+	*p = NL;
+	return program_end+sizeof(LINENUM);
+}
+
+/***********************************************************/
+//Terminal scrollback store in SPI RAM, one row per block transfer
+
+static void scrollback_Write(u16 row, const u8 *tiles){
+	SpiRamBlockWrite(SCROLLBACK_BASE+((u32)row*VRAM_TILES_H), tiles, VRAM_TILES_H);
+}
+
+static void scrollback_Read(u16 row, u8 *tiles){
+	SpiRamBlockRead(SCROLLBACK_BASE+((u32)row*VRAM_TILES_H), tiles, VRAM_TILES_H);
+}
+
+/***********************************************************/
+//TERM: UART Rx goes through the terminal's ANSI/UTF-8 filters to the screen, keys go out on UART Tx
+
+static void term_Send(u8 c){
+	while(IsUartTxBufferFull());
+	UartSendChar(c);
+}
+
+static void term_Run(){
+	u8 span[TERM_SPAN];
+	bool xoff = false;
+	stream_SerialFlush();//nothing of ours still queued ahead of the keys
+	terminal_LockSmoothScroll(true);//the ring can't wait for lines to slide in
+	while(1){
+		u8 n = 0;
+		while(n < TERM_SPAN && UartUnreadCount())
+			span[n++] = UartReadChar();
+
+		u8 waiting = UartUnreadCount();//hold the host off before the ring can overflow
+		if(!xoff && waiting >= TERM_XOFF_LEVEL){
+			term_Send(CTRLS);
+			xoff = true;
+		}else if(xoff && waiting <= TERM_XON_LEVEL){
+			term_Send(CTRLQ);
+			xoff = false;
+		}
+
+		if(n)
+			terminal_WriteSpan(span, n);
+
+		while(terminal_HasChar() && !IsUartTxBufferFull()){
+			u8 c = terminal_GetChar();
+			if(c == TERM_EXIT){
+				if(xoff)
+					term_Send(CTRLQ);
+				terminal_LockSmoothScroll(false);
+				return;
+			}
+			UartSendChar(c);
+		}
 	}
 }
 
 void cmd_Files(){
+	FILINFO entry;
+
+	if(fcache_dir_count != FCACHE_DIR_UNKNOWN){//listed before and nothing written since
+		for(u8 i=0; i<fcache_dir_count; i++){
+			if(GetVsyncFlag()) WaitVsync(1);
+			SpiRamBlockRead(FCACHE_DIR_BASE+(u32)i*sizeof(FILINFO), &entry, sizeof(FILINFO));
+			files_Print(&entry);
+		}
+		return;
+	}
+
 	DIR d;
 	if(f_opendir(&d, "/") != FR_OK)
 		return;
-	FILINFO entry;
+	u8 n = 0;
+	bool cache = (run_flags & SPIR_INITIALIZED) != 0;
 
 	while(1){
 		if(GetVsyncFlag()) WaitVsync(1);
-		if(f_readdir(&d, &entry) != FR_OK || entry.fname[0] == 0)
+		if(f_readdir(&d, &entry) != FR_OK){
+			cache = false;
 			break;
-		//common header
-		printmsgNoNL(indentmsg);
-		printmsgNoNL((const char *)entry.fname);
-		if(entry.fattrib & AM_DIR){
-			printmsgNoNL(slashmsg);
-			u8 found_end = 0;
-			for(u8 i=0; i<13 ; i++){
-				if(entry.fname[i] == '\0')
-					found_end = 1;
-				if(found_end)
-					printmsgNoNL(spacemsg);
-			}
-			printmsgNoNL(dirextmsg);
-		}else{//file ending
-			u8 found_end = 0;
-			for(u8 i=0; i<13 ; i++){
-				if(entry.fname[i] == '\0')
-					found_end = 1;
-				if(found_end)
-					printmsgNoNL(spacemsg);
-			}
-			printnum(entry.fsize);
 		}
-		line_terminator();
+		if(entry.fname[0] == 0)
+			break;
+		files_Print(&entry);
+		if(n == FCACHE_DIR_ENTRIES)//too many to index
+			cache = false;
+		else if(cache)
+			SpiRamBlockWrite(FCACHE_DIR_BASE+(u32)n++*sizeof(FILINFO), &entry, sizeof(FILINFO));
 	}
+	if(cache)
+		fcache_dir_count = n;
 	f_close(&f);
 }
 
@@ -2021,140 +3904,307 @@ void noTone(){
 void pinMode(u8 pin, u8 mode){
 }
 
-#define SPIR_CURSOR_IDLE	0
-#define SPIR_CURSOR_READ	1//always sequential
-#define SPIR_CURSOR_WRITE	2//always sequential
+#ifndef SPIR_CACHE_LINE_SIZE
+	#define SPIR_CACHE_LINE_SIZE	16//must be a power of 2
+#endif
+#ifndef SPIR_CACHE_SETS
+	#define SPIR_CACHE_SETS		4//must be a power of 2
+#endif
+#ifndef SPIR_CACHE_WAYS
+	#define SPIR_CACHE_WAYS		2
+#endif
+#define SPIR_CACHE_INVALID	0xFFFF
+#if SPIR_SIZE/SPIR_CACHE_LINE_SIZE > SPIR_CACHE_INVALID
+	#error SPIR_CACHE_LINE_SIZE too small for a u16 line tag
+#endif
+#define SPIR_CACHE_DIRTY	1
+
+//Small write-back cache in front of the SPI RAM. Fills and write backs go through the bus
+//arbiter, so a run of lines at consecutive addresses is one sequential transaction.
+struct spiram_cache_line{
+	u16 tag;//line number(address/SPIR_CACHE_LINE_SIZE) or SPIR_CACHE_INVALID
+	u8 flags;
+	u8 age;//0 = most recently used way of the set
+	u8 data[SPIR_CACHE_LINE_SIZE];
+};
 
-u32 spiram_cursor = 0;
-u32 spiram_buffer_pos = 0;
-u8 spiram_buffer_val = 0;
-u8 spiram_state = 0;
-u8 spiram_last_state = 0;
+struct spiram_cache_line spiram_cache[SPIR_CACHE_SETS][SPIR_CACHE_WAYS];
+u32 spiram_cache_hits = 0;
+u32 spiram_cache_misses = 0;
+u32 spiram_cache_writebacks = 0;
+
+static u8 spibus_owner = SPIBUS_IDLE;
+static uint32_t spibus_addr;//next address of the open SPI RAM sequence
+u32 spibus_switches = 0;//bus handed between the SD card and the SPI RAM
+u32 spibus_seeks = 0;//SPI RAM sequence restarted at another address or direction
+u32 spibus_continued = 0;//accesses that carried on an open sequence
+
+//SPI bus arbiter. The SD card(FatFs) and the SPI RAM share the bus, this tracks who has it and
+//leaves an SPI RAM sequence open, so the next access at the following address just carries on.
+static void spibus_Close(){
+	if(spibus_owner == SPIBUS_RAM_READ){
+		SpiRamSeqReadEnd();
+		asm("nop");asm("nop");
+	}else if(spibus_owner == SPIBUS_RAM_WRITE){
+		SpiRamSeqWriteEnd();
+		asm("nop");asm("nop");
+	}
+	spibus_owner = SPIBUS_IDLE;
+}
 
-uint8_t SpiRamCursorInit(){
-	spiram_state = SPIR_CURSOR_IDLE;
-	return SpiRamInit();
+void spibus_Sd(){//before any FatFs call
+	if(spibus_owner == SPIBUS_SD)
+		return;
+	if(spibus_owner != SPIBUS_IDLE){
+		spibus_Close();
+		spibus_switches++;
+	}
+	spibus_owner = SPIBUS_SD;
 }
 
-uint8_t SpiRamCursorRead(uint32_t addr){//assumes SPI RAM is not yielded
-	if(spiram_state != SPIR_CURSOR_READ){//in a sequential write or yielded?
-		//if(spiram_state == SPIR_CURSOR_WRITE)
-			SpiRamSeqWriteEnd();
-		asm("nop");asm("nop");
-		SpiRamSeqReadStart((addr&0xFF0000)>>16, (u16)(addr&0xFFFF));
-		asm("nop");asm("nop");
-		spiram_state = SPIR_CURSOR_READ;
-		spiram_cursor = addr+1;
-		return SpiRamSeqReadU8();
+static void spibus_RamOpen(u8 mode, uint32_t addr){
+	if(spibus_owner == mode && spibus_addr == addr){
+		spibus_continued++;
+		return;
 	}
-	if(spiram_cursor != addr){//current sequential read position doesn't match?
-		SpiRamSeqReadEnd();
-		asm("nop");asm("nop");
-		SpiRamSeqReadStart((addr&0xFF0000)>>16, (u16)(addr&0xFFFF));
-		asm("nop");asm("nop");
-		spiram_cursor = addr+1;
-		return SpiRamSeqReadU8();
+	if(spibus_owner == SPIBUS_SD)
+		spibus_switches++;
+	else if(spibus_owner != SPIBUS_IDLE)
+		spibus_seeks++;
+	spibus_Close();
+	if(mode == SPIBUS_RAM_READ)
+		SpiRamSeqReadStart(addr>>16, (u16)(addr&0xFFFF));
+	else
+		SpiRamSeqWriteStart(addr>>16, (u16)(addr&0xFFFF));
+	spibus_owner = mode;
+	spibus_addr = addr;
+}
+
+static void spibus_RamRead(uint32_t addr, u8 *dst, u16 len){
+	spibus_RamOpen(SPIBUS_RAM_READ, addr);
+	spibus_addr += len;
+	while(len--)
+		*dst++ = SpiRamSeqReadU8();
+}
+
+static void spibus_RamWrite(uint32_t addr, const u8 *src, u16 len){
+	spibus_RamOpen(SPIBUS_RAM_WRITE, addr);
+	spibus_addr += len;
+	while(len--)
+		SpiRamSeqWriteU8(*src++);
+}
+
+static void SpiRamCacheWriteBack(struct spiram_cache_line *l){
+	if(!(l->flags & SPIR_CACHE_DIRTY))
+		return;
+	spibus_RamWrite((u32)l->tag*SPIR_CACHE_LINE_SIZE, l->data, SPIR_CACHE_LINE_SIZE);
+	l->flags &= ~SPIR_CACHE_DIRTY;
+	spiram_cache_writebacks++;
+}
+
+void SpiRamCacheInvalidate(){//drops all lines, dirty data is lost(call SpiRamCursorYield() first)
+	for(u8 s=0;s<SPIR_CACHE_SETS;s++){
+		for(u8 w=0;w<SPIR_CACHE_WAYS;w++){
+			spiram_cache[s][w].tag = SPIR_CACHE_INVALID;
+			spiram_cache[s][w].flags = 0;
+			spiram_cache[s][w].age = w;
+		}
 	}
-	spiram_cursor++;
-	return SpiRamSeqReadU8();
 }
 
-uint8_t SpiRamCursorReadBuffered(uint32_t addr){//useful if you end up needing the previous byte read...
-	if(addr == spiram_buffer_pos)
-		return spiram_buffer_val;
-	spiram_buffer_pos = addr;
-	if(spiram_state != SPIR_CURSOR_READ){//in a sequential write or yielded?
-		//if(spiram_state == SPIR_CURSOR_WRITE)
-			SpiRamSeqWriteEnd();
-		asm("nop");asm("nop");
-		SpiRamSeqReadStart((addr&0xFF0000)>>16, (u16)(addr&0xFFFF));
-		asm("nop");asm("nop");
-		spiram_state = SPIR_CURSOR_READ;
-		spiram_cursor = addr+1;
-		spiram_buffer_val = SpiRamSeqReadU8();
-		return spiram_buffer_val;
+static struct spiram_cache_line *SpiRamCacheLookup(uint32_t addr){
+	addr &= SPIR_SIZE-1;//the chip ignores the address bits above its size, so the tags do as well
+	u16 tag = addr/SPIR_CACHE_LINE_SIZE;
+	struct spiram_cache_line *set = spiram_cache[tag&(SPIR_CACHE_SETS-1)];
+	struct spiram_cache_line *l = NULL;
+
+	for(u8 i=0;i<SPIR_CACHE_WAYS;i++){
+		if(set[i].tag == tag){
+			l = &set[i];
+			break;
+		}
 	}
-	if(spiram_cursor != addr){//current sequential read position doesn't match?
-		SpiRamSeqReadEnd();
-		asm("nop");asm("nop");
-		SpiRamSeqReadStart((addr&0xFF0000)>>16, (u16)(addr&0xFFFF));
-		asm("nop");asm("nop");
-		spiram_cursor = addr+1;
-		spiram_buffer_val = SpiRamSeqReadU8();
-		return spiram_buffer_val;
+
+	if(l != NULL){
+		spiram_cache_hits++;
+	}else{//miss, replace the least recently used way
+		spiram_cache_misses++;
+		l = &set[0];
+		for(u8 i=1;i<SPIR_CACHE_WAYS;i++){
+			if(set[i].age > l->age)
+				l = &set[i];
+		}
+		SpiRamCacheWriteBack(l);
+		spibus_RamRead(addr&~(u32)(SPIR_CACHE_LINE_SIZE-1), l->data, SPIR_CACHE_LINE_SIZE);
+		l->tag = tag;
+		l->flags = 0;
+	}
+
+	for(u8 i=0;i<SPIR_CACHE_WAYS;i++){//everything newer than this line gets older
+		if(set[i].age < l->age)
+			set[i].age++;
 	}
-	spiram_cursor++;
-	spiram_buffer_val = SpiRamSeqReadU8();
-	return spiram_buffer_val;
+	l->age = 0;
+	return l;
+}
+
+uint8_t SpiRamCursorInit(){
+	SpiRamCacheInvalidate();
+	spiram_cache_hits = spiram_cache_misses = spiram_cache_writebacks = 0;
+	spibus_switches = spibus_seeks = spibus_continued = 0;
+	spibus_owner = SPIBUS_IDLE;
+	return SpiRamInit();
+}
+
+uint8_t SpiRamCursorRead(uint32_t addr){//assumes SPI RAM is not yielded
+	return SpiRamCacheLookup(addr)->data[addr&(SPIR_CACHE_LINE_SIZE-1)];
+}
+
+uint8_t SpiRamCursorReadBuffered(uint32_t addr){//kept for compatibility, the cache line already holds the previous bytes
+	return SpiRamCursorRead(addr);
 }
 
 void SpiRamCursorWrite(uint32_t addr, uint8_t val){//assumes SPI RAM is not yielded
-	if(spiram_state < SPIR_CURSOR_WRITE){//in a sequential read or yielded?
-		//if(spiram_state == SPIR_CURSOR_READ)
-			SpiRamSeqReadEnd();
-		asm("nop");asm("nop");
-		SpiRamSeqWriteStart((addr&0xFF0000)>>16, (u16)(addr&0xFFFF));
-		asm("nop");asm("nop");
-		spiram_state = SPIR_CURSOR_WRITE;
-		spiram_cursor = addr+1;
-		SpiRamSeqWriteU8(val);
-		return;
+	struct spiram_cache_line *l = SpiRamCacheLookup(addr);
+	l->data[addr&(SPIR_CACHE_LINE_SIZE-1)] = val;
+	l->flags |= SPIR_CACHE_DIRTY;
+}
+
+void SpiRamCursorYield(){//allow SD access, anything dirty is written back so the SPI RAM contents are current
+	for(u8 s=0;s<SPIR_CACHE_SETS;s++){
+		for(u8 w=0;w<SPIR_CACHE_WAYS;w++)
+			SpiRamCacheWriteBack(&spiram_cache[s][w]);
 	}
-	if(spiram_cursor != addr){//current sequential write position doesn't match?
-		SpiRamSeqWriteEnd();
-		asm("nop");asm("nop");
-		spiram_cursor = addr+1;
-		SpiRamSeqWriteStart((addr&0xFF0000)>>16, (u16)(addr&0xFFFF));
-		asm("nop");asm("nop");
-		SpiRamSeqWriteU8(val);
-		return;
+}
+
+void SpiRamCursorUnyield(){//the arbiter reopens a sequence on the next access, there is nothing to restart
+}
+
+static void SpiRamCacheRange(uint32_t addr, u16 len, bool drop){//writes back the lines overlapping [addr,addr+len), then drops them if asked
+	for(u8 s=0;s<SPIR_CACHE_SETS;s++){
+		for(u8 w=0;w<SPIR_CACHE_WAYS;w++){
+			struct spiram_cache_line *l = &spiram_cache[s][w];
+			if(l->tag == SPIR_CACHE_INVALID)
+				continue;
+			u32 start = (u32)l->tag*SPIR_CACHE_LINE_SIZE;
+			if(start >= addr+len || start+SPIR_CACHE_LINE_SIZE <= addr)
+				continue;
+			SpiRamCacheWriteBack(l);
+			if(drop){
+				l->tag = SPIR_CACHE_INVALID;
+				l->flags = 0;
+			}
+		}
 	}
-	spiram_cursor++;
-	SpiRamSeqWriteU8(val);
 }
 
-void SpiRamCursorYield(){//allow SD access
-	spiram_last_state = spiram_state;
-	if(spiram_state == SPIR_CURSOR_READ)
-		SpiRamSeqReadEnd();
-	else if(spiram_state == SPIR_CURSOR_WRITE)
-		SpiRamSeqWriteEnd();
-	spiram_state = SPIR_CURSOR_IDLE;
+void SpiRamBlockWrite(uint32_t addr, const void *src, u16 len){//one sequential write, bypassing the cache
+	SpiRamCacheRange(addr, len, true);//lines elsewhere stay cached
+	spibus_RamWrite(addr, src, len);
 }
 
-void SpiRamCursorUnyield(){//this exists so assumptions can be made in read/write
-	spiram_state = spiram_last_state;
-	if(spiram_state == SPIR_CURSOR_READ)
-		SpiRamSeqReadStart((spiram_cursor&0xFF0000)>>16, (u16)(spiram_cursor&0xFFFF));
-	else if(spiram_state == SPIR_CURSOR_WRITE)
-		SpiRamSeqWriteStart((spiram_cursor&0xFF0000)>>16, (u16)(spiram_cursor&0xFFFF));
+void SpiRamBlockRead(uint32_t addr, void *dst, u16 len){//one sequential read, bypassing the cache
+	SpiRamCacheRange(addr, len, false);
+	spibus_RamRead(addr, dst, len);
 }
 
 u8 SpiRamCursorLoad(char *fname, u32 foff, u32 dlen, u32 roff){
+	//the free space between the program and the variables is the transfer buffer, so
+	//whole sectors are read straight into it and streamed out in one SPI RAM sequence
+	u8 small_buf[16];
+	struct packed_header ph;
+	u8 *buf = program_end;
+	u16 bsize;
+	u8 ret = 1;
+
+	if(current_line == NULL){//a direct command line is parked at program_end, start past its NL
+		buf += sizeof(LINENUM);
+		while(*buf != NL)
+			buf++;
+		buf++;
+	}
+	bsize = variables_begin-buf;
+
+	if(bsize >= SPIR_LOAD_CHUNK)
+		bsize = SPIR_LOAD_CHUNK;
+	else if(bsize >= SD_SECTOR_SIZE)
+		bsize = SD_SECTOR_SIZE;
+	else if(bsize < sizeof(small_buf)){
+		buf = small_buf;
+		bsize = sizeof(small_buf);
+	}
+	if(roff >= SPIR_USER_TOP){
+		printmsg(spirtopmsg);
+		return 0;
+	}
+
 	SpiRamCursorYield();
-	if(f_open(&f, (const char*)fname, FA_READ) == FR_OK){
-		u8 d;
-
-		while(dlen == 999999UL || dlen--){
-			f_read(&f, &d, 1, &bytesRead);
-			foff++;
-			if(bytesRead != 1){
-				if(dlen == 999999UL)
-					goto SPIR_CURSOR_LOAD_FINISH;
-				printmsg(PSTR("ERROR Ran out of file bytes"));
-				return 0;
-			}
-			SpiRamWriteU8((roff>>16), (roff&0xFFFF), d);//pretty slow..TODO add small buffer?
-			roff++;
-		}
-		
-	}else{
+	if(fcache_Open((const char*)fname) != FR_OK){
 		printmsg(sdfilemsg);
+		ret = 0;
+		goto SPIR_CURSOR_LOAD_FINISH;
+	}
+	if(foff && (f_lseek(&f, foff) != FR_OK || f.fptr != foff)){
+		printmsg(PSTR("ERROR Offset past end of file"));
+		ret = 0;
+		goto SPIR_CURSOR_LOAD_FINISH;
+	}
+	u8 packed = PACK_NONE;
+	if(dlen == DLOAD_TO_EOF || dlen >= sizeof(struct packed_header))
+		packed = unpack_Probe(&ph, SPIR_USER_TOP-roff);
+	if(packed == PACK_TOO_BIG){
+		printmsg(packmsg);
+		ret = 0;
+		goto SPIR_CURSOR_LOAD_FINISH;
+	}
+	if(packed == PACK_FOUND){//written through the cache instead
+		stream_FileReset();
+		if(dlen != DLOAD_TO_EOF)
+			stream_FileLimit(dlen-sizeof(struct packed_header));
+		if(!unpack_Run(&ph, PAK_TO_SPIRAM, roff, ph.size)){
+			printmsg(packmsg);
+			ret = 0;
+		}
+		SpiRamCursorYield();//write back before the cache is dropped
+		goto SPIR_CURSOR_LOAD_FINISH;
+	}
+
+	if(dlen == DLOAD_TO_EOF)
+		dlen = f_size(&f)-f.fptr;
+	if(dlen > SPIR_USER_TOP-roff){
+		printmsg(spirtopmsg);
+		ret = 0;
+		goto SPIR_CURSOR_LOAD_FINISH;
+	}
+	while(dlen){
+		u16 chunk = bsize;
+		u16 misalign = (u16)(f.fptr&(SD_SECTOR_SIZE-1));
+		if(misalign && SD_SECTOR_SIZE-misalign < chunk)//realign so the following reads bypass the FatFs sector window
+			chunk = SD_SECTOR_SIZE-misalign;
+		if(dlen != DLOAD_TO_EOF && dlen < chunk)
+			chunk = dlen;
+
+		f_read(&f, buf, chunk, &bytesRead);
+		if(bytesRead){
+			spibus_RamWrite(roff, buf, bytesRead);
+			roff += bytesRead;
+		}
+		if(bytesRead != chunk){
+			if(dlen == DLOAD_TO_EOF)
+				break;
+			printmsg(PSTR("ERROR Ran out of file bytes"));
+			ret = 0;
+			break;
+		}
+		if(dlen != DLOAD_TO_EOF)
+			dlen -= chunk;
 	}
+
 SPIR_CURSOR_LOAD_FINISH:
 	f_close(&f);
+	SpiRamCacheInvalidate();//written around the cache
 	SpiRamCursorUnyield();
-	return 1;
+	return ret;
 }
 
 void CustomWaitVsync(u8 frames){//we do a best effort to keep up to the demand of the song player.
@@ -17,6 +17,7 @@
 #include <util/atomic.h>
 #include <stdlib.h>
 #include <avr/pgmspace.h>
+#include <avr/cpufunc.h>
 #include <uzebox.h>
 #include "keyboard.h"
 #include "terminal.h"
@@ -27,7 +28,18 @@
 #define FIRST_TILE_OFFSET	32
 #define CUR_DEF_SPEED		30
 #define CUR_TILE 			123
-#define XMIT_BUF_SIZE 		32	//must be a power of 2
+#ifndef XMIT_BUF_SIZE
+	#define XMIT_BUF_SIZE 	32	//keys waiting for the program, can be set from the makefile
+#endif
+#if (XMIT_BUF_SIZE & (XMIT_BUF_SIZE-1)) || XMIT_BUF_SIZE>256
+	#error XMIT_BUF_SIZE must be a power of 2, 256 at most
+#endif
+#define XMIT_BUF_MASK		(XMIT_BUF_SIZE-1)
+#define ECHO_BUF_SIZE		8	//power of 2
+#define ECHO_BUF_MASK		(ECHO_BUF_SIZE-1)
+#ifndef VRAM_QUEUE_SIZE
+	#define VRAM_QUEUE_SIZE	0	//cells changed per frame in deferred mode, 0 leaves it out. Can be set from the makefile
+#endif
 
 #if VIDEO_MODE==80
 	#define MAX_TILE 139
@@ -61,14 +73,36 @@ bool ansi_filter(u8 c);
 bool utf8_filter(u8 c);
 void process_joypad_entry();
 void copyLine(u8 src, u8 dest);
+static u8 vram_Row(u8 y);
 
 bool DECCKM=false;				//Enable DEC escape sequences for extended keyboard keys
 bool DECAWM=false;				//Enables Auto-wrap mode
 
 //display list definition for video mode 80
 #if VIDEO_MODE==80
-m80_dlist_tdef dlist[1];
+#define DLIST_ENTRIES		4	//scroll region plus up to 3 pinned rows
+
+//Entries are in screen order: one per pinned row above the scroll region, the
+//region itself, then one per pinned row below it. A pinned row can sit in any
+//VRAM row, so scrolling the region only ever moves the single pinned row it runs into.
+m80_dlist_tdef dlist[DLIST_ENTRIES];
 m80_cursor_tdef cursor;
+u8 dlist_count;
+bool dlist_split;				//false when the margins pin too many rows, regions then scroll by copying
+u8 dlist_region;				//entry of the scroll region
+
+//The region's entry is only the displayed position. The vsync callback moves it a few
+//pixels per frame towards region_row/region_fine, where text is actually written.
+u8 region_row;
+u8 region_fine;
+volatile s16 scroll_pending;	//pixels left to animate, positive is up
+u8 scroll_speed=1;				//pixels per frame
+u8 smooth_speed;				//0: terminal output scrolls instantly
+bool smooth_locked;				//output scrolls instantly whatever smooth_speed and DECSCLM say
+static void dlist_Build();
+static void dlist_Normalize();
+static void cursor_Update();
+static void scroll_Step();
 #endif
 
 //Terminal control variables
@@ -83,23 +117,75 @@ u8 scroll_top_margin;
 u8 scroll_bottom_margin;
 
 
-////ANSI filter variables
-//bool escaping=false, is_ansi=false, csi_extension=false;
-//char csi_buffer[32];
-//u8 command_line;
-//u8 csi_ptr;
-//u8 csi_params[10];
-//u8 csi_param_ptr;
-//u8 csi_param_count;
-//u16 esc_pos=0;
-//char escape_buf[20];
-//char param_buf[7];
-//char parsed_param[7];
-
-//circular buffer and pointers to holds ansi data for the output stream
+//ANSI filter variables
+#define ANSI_GROUND			0	//plain text
+#define ANSI_ESC			1	//after ESC
+#define ANSI_CSI			2	//after ESC[
+#define ANSI_ESC_INT		3	//after ESC and an intermediate byte, ESC(B and the like
+#define ANSI_STRING			4	//OSC/DCS strings, ended by BEL or ST
+#define CSI_MAX_PARAMS		4
+u8 ansi_state=ANSI_GROUND;
+bool csi_private;				//'?' seen, DEC private mode
+u8 csi_count;					//parameters started so far
+u8 csi_params[CSI_MAX_PARAMS+1];	//the last one soaks up any extra parameters
+u8 save_cx,save_cy;				//ESC 7/ESC 8
+
+//Scrollback. Mode 80 with more VRAM rows than the screen keeps history in the rows the
+//screen isn't showing and views it by moving the display list, otherwise rows are handed
+//to the store set with terminal_SetScrollback().
+#if VIDEO_MODE==80 && VRAM_TILES_V>SCREEN_TILES_V
+	#define SCROLLBACK_VRAM		1
+#endif
+#define SCROLLBACK_PAGE		(SCREEN_TILES_V-1)
+u16 sb_count;					//rows of history kept
+u16 sb_view;					//rows scrolled back, 0 is the live screen
+volatile s8 sb_request;			//pages asked for by PgUp/PgDn, applied outside of the vsync callback
+#ifndef SCROLLBACK_VRAM
+u16 sb_lines;					//size of the store's ring, 0 if there is no store
+u16 sb_head;					//next ring row to write
+void (*sb_write)(u16 row, const u8 *tiles);
+void (*sb_read)(u16 row, u8 *tiles);
+#endif
+static void scrollback_Live();
+
+//Deferred writes. Tiles wait in a queue, one entry per cell, and the vsync callback
+//stores them during vertical blank so the screen never changes mid-frame. Anything
+//that reads or moves VRAM flushes the queue first.
+#if VRAM_QUEUE_SIZE
+bool vq_enabled;
+volatile bool vq_busy;			//the program is changing the queue, the vsync callback leaves it be
+u8 vq_count;
+u16 vq_pos[VRAM_QUEUE_SIZE];
+u8 vq_tile[VRAM_QUEUE_SIZE];
+static void vram_Put(u16 pos, u8 tile);
+static void vq_Flush();
+#else
+#define vq_enabled			false
+#define vram_Put(pos,tile)
+#define vq_Flush()
+#endif
+
+//UTF-8 filter variables
+#define UTF8_ACCEPT			0	//DFA states
+#define UTF8_REJECT			12
+#define UTF8_UNKNOWN		0x80	//square symbol - unsupported characters
+u8 utf8_state=UTF8_ACCEPT;
+u32 utf8_codep;
+
+//circular buffer and pointers to holds ansi data for the output stream.
+//Single producer(the vsync callback) and single consumer(the program), so
+//each side only ever writes its own pointer and no locking is needed.
 u8 xmit_buf[XMIT_BUF_SIZE];
 volatile u8 xmit_headPtr=0;
 volatile u8 xmit_tailPtr=0;
+volatile u16 xmit_overflows=0;	//keys dropped because the buffer was full
+
+//Keys to echo. Drawing can scroll, use the SPI bus or the deferred write queue,
+//none of which the vsync callback may touch, so the program draws them when it polls.
+u8 echo_buf[ECHO_BUF_SIZE];
+volatile u8 echo_headPtr=0;
+volatile u8 echo_tailPtr=0;
+static void echo_Draw();
 
 //Input stream definition macro. Allows the use of stdio functions.
 FILE TERMINAL_STREAM = FDEV_SETUP_STREAM(cons_putchar_printf, NULL, _FDEV_SETUP_WRITE);
@@ -144,17 +230,19 @@ void terminal_Init(){
 	cursorEnable=true;
 	debugEcho=false;
 	inverseVideo=false;
-//	escaping=false;
-//	is_ansi=false;
-//	csi_extension=false;
-//	esc_pos=0;
+	ansi_state=ANSI_GROUND;
+	utf8_state=UTF8_ACCEPT;
 	xmit_headPtr=0;
 	xmit_tailPtr=0;
+	xmit_overflows=0;
 	DECCKM=false;
 	DECAWM=false;
 
 	scroll_top_margin=0;
 	scroll_bottom_margin=SCREEN_TILES_V-1;
+#if VIDEO_MODE==80
+	dlist_Build();
+#endif
 }
 
 /*
@@ -164,12 +252,58 @@ int cons_putchar_printf(char c, FILE *stream) {
 	//filter the stream for ANSI escape sequences and UTF-8 characters
 	//filters return false to stop the filter chain and true
 	//to continue or print the received char
-	//if(!ansi_filter(c))return 0;
-	//if(!utf8_filter(c))return 0;
+	scrollback_Live();
+	if(!ansi_filter(c))return 0;
+	if(!utf8_filter(c))return 0;
 	cons_char(c);
     return 0;
 }
 
+/**
+ * Writes a run of characters at the cursor. Printable characters are stored
+ * straight into VRAM, one row address per run, everything else(control
+ * characters, escape sequences, line wraps) goes through the filters one at a time.
+ */
+void terminal_WriteSpan(const u8 *s, u16 len){
+	scrollback_Live();
+	while(len){
+		u8 c=*s;
+		if(c<FIRST_TILE_OFFSET || c>MAX_TILE || cx>=SCREEN_TILES_H || ansi_state!=ANSI_GROUND || utf8_state!=UTF8_ACCEPT){
+			cons_putchar_printf(c,NULL);
+			s++;
+			len--;
+			continue;
+		}
+
+#if VIDEO_MODE==80
+		u8 base=FIRST_TILE_OFFSET-(inverseVideo?128:0);
+#else
+		u8 base=FIRST_TILE_OFFSET;
+#endif
+		u16 pos=(vram_Row(cy)*VRAM_TILES_H)+cx;
+		u8 room=SCREEN_TILES_H-cx;
+		if(room>len) room=len;
+
+		u8 n=0;
+		if(vq_enabled){
+			while(n<room && (c=s[n])>=FIRST_TILE_OFFSET && c<=MAX_TILE){
+				vram_Put(pos+n,c-base);
+				n++;
+			}
+		}else{
+			u8 *p=&vram[pos];
+			while(n<room && (c=s[n])>=FIRST_TILE_OFFSET && c<=MAX_TILE){//same tiles terminal_PutCharAtLoc() sets
+				p[n]=c-base;
+				n++;
+			}
+		}
+		s+=n;
+		len-=n;
+		cx+=n;
+		terminal_MoveCursor(cx,cy);
+	}
+}
+
 /**
  * Send a char to the video terminal. Delegates to the stream handler.
  */
@@ -183,9 +317,11 @@ void terminal_SendChar(u8 c){
  */
 u8 terminal_GetChar(){
     while(xmit_headPtr==xmit_tailPtr){};				// block waiting for a char to be appended
+	echo_Draw();
 
-    u8 c = xmit_buf[xmit_tailPtr];
-	xmit_tailPtr = (xmit_tailPtr + 1) % XMIT_BUF_SIZE;
+    u8 tail = xmit_tailPtr;
+    u8 c = xmit_buf[tail];
+	xmit_tailPtr = (tail + 1) & XMIT_BUF_MASK;
     return c;
 }
 
@@ -193,6 +329,15 @@ u8 terminal_GetChar(){
  * Return if one or more keys are in the terminal output buffer.
  */
 bool terminal_HasChar(){
+	echo_Draw();
+	if(sb_request){//paging asked for by the keyboard
+		s8 pages;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+			pages=sb_request;
+			sb_request=0;
+		}
+		terminal_ScrollbackView(pages*SCROLLBACK_PAGE);
+	}
 	return xmit_headPtr!=xmit_tailPtr;
 }
 
@@ -201,13 +346,20 @@ bool terminal_HasChar(){
  */
 void terminal_VsyncCallback(){
 
+#if VRAM_QUEUE_SIZE
+	if(vq_count && !vq_busy) vq_Flush();	//first, while the beam is still in vertical blank
+#endif
+
 	KeyboardPoll();			//checks for new keys
 
-	//process the keyboard
-	if(KeyboardHasKey()){
+	//process the keyboard, everything that came in this frame
+	while(KeyboardHasKey()){
 		u8 key=KeyboardGetKey(true);
 		terminal_ProcessKey(key);
 	}
+#if VIDEO_MODE==80
+	if(scroll_pending) scroll_Step();
+#endif
 }
 
 
@@ -215,8 +367,36 @@ void terminal_VsyncCallback(){
  * Append a char to the transmit buffer.
  */
 void terminal_TransmitChar(u8 c){
-    xmit_buf[xmit_headPtr] = c;
-    xmit_headPtr = (xmit_headPtr + 1) % XMIT_BUF_SIZE;
+	u8 head = xmit_headPtr;
+	u8 next = (head + 1) & XMIT_BUF_MASK;
+	if(next == xmit_tailPtr){	//full, keep what the program hasn't read yet
+		if(xmit_overflows != 0xffff) xmit_overflows++;
+		return;
+	}
+    xmit_buf[head] = c;
+    xmit_headPtr = next;
+}
+
+/*
+ * Draws the keys the vsync callback queued for echo.
+ */
+static void echo_Draw(){
+	if(echo_tailPtr==echo_headPtr) return;
+	scrollback_Live();
+	while(echo_tailPtr!=echo_headPtr){
+		u8 tail=echo_tailPtr;
+		cons_char(echo_buf[tail]);
+		echo_tailPtr=(tail+1)&ECHO_BUF_MASK;
+	}
+	terminal_MoveCursor(cx,cy);
+}
+
+u16 terminal_GetOverflowCount(){
+	u16 n;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		n=xmit_overflows;
+	}
+	return n;
 }
 
 /**
@@ -245,6 +425,8 @@ void terminal_ProcessKey(u8 c){
 	const char* command=NULL;
 	if((mods & KB_FLAG_CTRL) && ((c&0xff)>='a' && (c&0xff)<='z')){
 		terminal_TransmitChar((c&0xff)-'a'+1);	//process Control-A to Control-Z keys
+	}else if((mods & KB_FLAG_CTRL) && ((c&0xff)>='[' && (c&0xff)<='_')){
+		terminal_TransmitChar((c&0xff)-'@');	//Control-[ to Control-_ (ESC, FS, GS, RS, US)
 	}else{
 		switch(c){
 			case KB_UP: //Up arrow
@@ -338,12 +520,25 @@ void terminal_ProcessKey(u8 c){
 				terminal_SetCursorVisible(false);
 				break;
 
+			case KB_PGUP:	//view the scrollback, the store can't be touched from here
+				if(sb_request<16) sb_request++;
+				break;
+
+			case KB_PGDN:
+				if(sb_request>-16) sb_request--;
+				break;
+
 			case 0:
 				break;
 
 			default:
 				if(echoEnable){
-					cons_char(c);
+					u8 head=echo_headPtr;
+					u8 next=(head+1)&ECHO_BUF_MASK;
+					if(next!=echo_tailPtr){
+						echo_buf[head]=c;
+						echo_headPtr=next;
+					}
 				}
 				terminal_TransmitChar(c);
 				break;
@@ -351,8 +546,6 @@ void terminal_ProcessKey(u8 c){
 
 		if(command!=NULL) terminal_TransmitString_P(command);
 	}
-
-	terminal_MoveCursor(cx,cy);
 }
 
 
@@ -366,6 +559,9 @@ void terminal_Echo(bool enable){
 }
 
 void terminal_ClearScreen(){
+#if VRAM_QUEUE_SIZE
+	vq_count=0;
+#endif
 	ClearVram();
 }
 
@@ -375,9 +571,7 @@ void terminal_MoveCursor(u8 x,u8 y){
 	cy=y;
 
 #if VIDEO_MODE==80
-	//update mode80 cursor
-	cursor.x=x;
-	cursor.y=y;
+	cursor_Update();
 #endif
 }
 
@@ -403,119 +597,611 @@ u8	terminal_GetVerticalScroll(){
 }
 */
 
-void terminal_SetScrollMargins(u8 top, u8 bottom){
-	scroll_top_margin=top;
-	scroll_bottom_margin=bottom;
+/*
+ * Returns the VRAM row currently displayed at screen row y.
+ */
+static u8 vram_Row(u8 y){
+#if VIDEO_MODE==80
+	if(!dlist_split){
+		y+=region_row;
+	}else if(y<scroll_top_margin){
+		return dlist[y].vramrow;
+	}else if(y>scroll_bottom_margin){
+		return dlist[y-scroll_bottom_margin+scroll_top_margin].vramrow;
+	}else{
+		y+=region_row-scroll_top_margin;
+	}
+	if(y>=VRAM_TILES_V) y-=VRAM_TILES_V;
+#endif
+	return y;
 }
 
-void terminal_VerticalScrollUp(bool clearNewLine){
+#if VIDEO_MODE==80
+/*
+ * Points the mode 80 cursor at cx,cy. The kernel offsets it by the
+ * displayed vramrow of the first entry.
+ */
+static void cursor_Update(){
+	u8 row=vram_Row(cy);
+	if(row<dlist[0].vramrow) row+=VRAM_TILES_V;
+	cursor.x=cx;
+	cursor.y=row-dlist[0].vramrow;
+}
+
+/*
+ * Called from the vsync callback, moves the displayed region up to
+ * scroll_speed pixels towards where it should be.
+ */
+static void scroll_Step(){
+	m80_dlist_tdef *e=&dlist[dlist_region];
+	s16 step=scroll_speed;
+	if(scroll_pending>0){
+		if(step>scroll_pending) step=scroll_pending;
+		scroll_pending-=step;
+		u8 t=e->tilerow+step;
+		if(t>=TILE_HEIGHT){
+			t-=TILE_HEIGHT;
+			e->vramrow=(e->vramrow==VRAM_TILES_V-1)?0:e->vramrow+1;
+		}
+		e->tilerow=t;
+	}else{
+		if(step>-scroll_pending) step=-scroll_pending;
+		scroll_pending+=step;
+		s8 t=e->tilerow-step;
+		if(t<0){
+			t+=TILE_HEIGHT;
+			e->vramrow=(e->vramrow==0)?VRAM_TILES_V-1:e->vramrow-1;
+		}
+		e->tilerow=t;
+	}
+	cursor_Update();
+}
 
-	//copy margin lines down 1 vram row
-	//TODO: top margin not supported, most be 0
-	if(scroll_bottom_margin != (SCREEN_TILES_V-1)){
-			for(u8 i=(SCREEN_TILES_V-1);i>scroll_bottom_margin;i--){
-			copyLine(i,i+1);
+static s16 scroll_Pending(){
+	s16 p;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		p=scroll_pending;
+	}
+	return p;
+}
+
+/*
+ * Moves the displayed region straight to where it should be.
+ */
+static void scroll_Snap(){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		scroll_pending=0;
+		dlist[dlist_region].vramrow=region_row;
+		dlist[dlist_region].tilerow=region_fine;
+	}
+}
 
+/*
+ * Hands a scroll of the region to the vsync callback, or shows it
+ * immediately if smooth scrolling is off.
+ */
+static void scroll_Animate(s16 pixels, u8 speed){
+	if(speed==0){
+		scroll_Snap();
+		return;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		scroll_speed=speed;
+		scroll_pending+=pixels;
+	}
+}
+
+/*
+ * Puts every screen row back in the VRAM row of the same number so the
+ * display list can be rebuilt from a known layout. Rows are swapped in place.
+ */
+static void dlist_Normalize(){
+	vq_Flush();
+	u8 map[SCREEN_TILES_V];
+	for(u8 y=0;y<SCREEN_TILES_V;y++){
+		map[y]=vram_Row(y);
+	}
+	for(u8 y=0;y<SCREEN_TILES_V;y++){
+		u8 row=map[y];
+		if(row==y) continue;
+		u8 *a=&vram[row*VRAM_TILES_H];
+		u8 *b=&vram[y*VRAM_TILES_H];
+		for(u8 i=0;i<VRAM_TILES_H;i++){
+			u8 t=a[i];
+			a[i]=b[i];
+			b[i]=t;
+		}
+		for(u8 z=y+1;z<SCREEN_TILES_V;z++){//whoever was in VRAM row y now lives where y was
+			if(map[z]==y){
+				map[z]=row;
+				break;
+			}
 		}
 	}
+}
+
+/*
+ * Lays out the display list for the current margins, assuming screen rows
+ * sit in the VRAM rows of the same number.
+ */
+static void dlist_Build(){
+	u8 pinned=scroll_top_margin+(SCREEN_TILES_V-1-scroll_bottom_margin);
+	dlist_split=(pinned<DLIST_ENTRIES);
+	dlist_count=dlist_split?pinned+1:1;
+	dlist_region=dlist_split?scroll_top_margin:0;
+	region_row=dlist_region;
+	region_fine=0;
+#ifdef SCROLLBACK_VRAM
+	sb_count=0;
+	sb_view=0;
+#endif
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		scroll_pending=0;
+	}
+
+	u8 line=0;
+	for(u8 i=0;i<dlist_count;i++){
+		u8 rows=1;
+		if(!dlist_split){
+			dlist[i].vramrow=0;
+			rows=SCREEN_TILES_V;
+		}else if(i<scroll_top_margin){
+			dlist[i].vramrow=i;
+		}else if(i==scroll_top_margin){
+			dlist[i].vramrow=i;
+			rows=scroll_bottom_margin-scroll_top_margin+1;
+		}else{
+			dlist[i].vramrow=i+scroll_bottom_margin-scroll_top_margin;
+		}
+		line+=rows*TILE_HEIGHT;
+		dlist[i].tilerow=0;
+		dlist[i].bgc=dlist[0].bgc;
+		dlist[i].fgc=dlist[0].fgc;
+		dlist[i].next=(i==dlist_count-1)?0:line;	//0 is never reached again, ends the list
+	}
+}
+
+/*
+ * Returns a VRAM row used by neither the region nor a pinned row, 0xff if
+ * there is none(VRAM_TILES_V==SCREEN_TILES_V).
+ */
+static u8 dlist_Spare(){
+	u8 last=region_row+(scroll_bottom_margin-scroll_top_margin);
+	for(u8 row=0;row<VRAM_TILES_V;row++){
+		if(last<VRAM_TILES_V){
+			if(row>=region_row && row<=last) continue;
+		}else if(row>=region_row || row<=last-VRAM_TILES_V){
+			continue;
+		}
+		u8 i;
+		for(i=0;i<dlist_count;i++){
+			if(i!=dlist_region && dlist[i].vramrow==row) break;
+		}
+		if(i==dlist_count) return row;
+	}
+	return 0xff;
+}
+
+/*
+ * The scroll region is about to take over VRAM row 'from'. If a pinned row
+ * lives there, move it to a spare row, or else to the row the region is
+ * giving up. A spare row keeps that row intact while a smooth scroll still shows it.
+ */
+static void dlist_Evict(u8 from, u8 to){
+	for(u8 i=0;i<dlist_count;i++){
+		if(i!=dlist_region && dlist[i].vramrow==from){
+			u8 spare=dlist_Spare();
+			if(spare!=0xff) to=spare;
+			memcpy(&vram[to*VRAM_TILES_H],&vram[from*VRAM_TILES_H],VRAM_TILES_H);
+			dlist[i].vramrow=to;
+			return;
+		}
+	}
+}
+#endif
+
+void terminal_SetScrollMargins(u8 top, u8 bottom){
+#if VIDEO_MODE==80
+	dlist_Normalize();
+#endif
+	scroll_top_margin=top;
+	scroll_bottom_margin=bottom;
 #if VIDEO_MODE==80
-	if(dlist[0].vramrow == SCREEN_TILES_V-1){
-		dlist[0].vramrow = 0;
+	dlist_Build();
+	terminal_MoveCursor(cx,cy);
+#endif
+}
+
+#if VIDEO_MODE!=80
+#define VRAM_COPY8(op)	op op op op op op op op
+
+/*
+ * Moves a block of VRAM eight tiles per loop pass, any remainder one tile
+ * at a time since VRAM_TILES_H needn't be a multiple of 8. Copies backward when the
+ * destination is above the source so overlapping rows are safe.
+ */
+static void vram_MoveRows(u8 *dest, u8 *src, u16 len){
+	u16 n=len>>3;
+	u8 tail=len&7;
+	if(dest<src){
+		if(n) asm volatile(
+			"1:\n\t"
+			VRAM_COPY8("ld __tmp_reg__,X+\n\t" "st Z+,__tmp_reg__\n\t")
+			"sbiw %[n],1\n\t"
+			"brne 1b\n\t"
+			: [n]"+w"(n), "+x"(src), "+z"(dest)
+			:
+			: "memory");
+		while(tail--) *dest++=*src++;
 	}else{
-		dlist[0].vramrow++;
+		src+=len;
+		dest+=len;
+		if(n) asm volatile(
+			"1:\n\t"
+			VRAM_COPY8("ld __tmp_reg__,-X\n\t" "st -Z,__tmp_reg__\n\t")
+			"sbiw %[n],1\n\t"
+			"brne 1b\n\t"
+			: [n]"+w"(n), "+x"(src), "+z"(dest)
+			:
+			: "memory");
+		while(tail--) *--dest=*--src;
 	}
+}
 #endif
-	if(scroll_bottom_margin == (SCREEN_TILES_V-1)){
-		terminal_ClearLine(SCREEN_TILES_V-1,0,SCREEN_TILES_H-1);
-	}else{
-		terminal_ClearLine(scroll_bottom_margin,0,SCREEN_TILES_H-1);
+
+/*
+ * Keeps the row about to scroll off the top of the screen.
+ */
+static void scrollback_Capture(){
+	if(sb_view) return;
+#ifdef SCROLLBACK_VRAM
+	//it stays where it is, above the region
+	if(dlist_count!=1 || !dlist_split){
+		sb_count=0;//pinned rows borrow the spare VRAM rows
+	}else if(sb_count<VRAM_TILES_V-SCREEN_TILES_V){
+		sb_count++;
 	}
+#else
+	if(sb_lines==0) return;
+	sb_write(sb_head,&vram[vram_Row(0)*VRAM_TILES_H]);
+	if(++sb_head==sb_lines) sb_head=0;
+	if(sb_count<sb_lines) sb_count++;
+#endif
+}
 
+/*
+ * Puts the live screen back if history is being viewed.
+ */
+static void scrollback_Live(){
+	if(sb_view) terminal_ScrollbackView(-(s16)sb_view);
 }
 
-void terminal_VerticalScrollDown(bool clearNewLine){
+void terminal_SetScrollback(u16 lines, void (*write)(u16 row, const u8 *tiles), void (*read)(u16 row, u8 *tiles)){
+#ifndef SCROLLBACK_VRAM
+	scrollback_Live();
+	sb_lines=lines;
+	sb_write=write;
+	sb_read=read;
+	sb_head=0;
+	sb_count=0;
+#endif
+}
 
-	//copy margin lines down 1 vram row
-	//TODO: top margin not supported, most be 0
-	if(scroll_bottom_margin != (SCREEN_TILES_V-1)){
-		for(u8 i=scroll_bottom_margin;i<SCREEN_TILES_V;i++){
+void terminal_ScrollbackView(s16 rows){
+	s16 view=sb_view+rows;
+	if(view<0) view=0;
+	if(view>(s16)sb_count) view=sb_count;
+	if(view==sb_view) return;
+	vq_Flush();
+
+#ifdef SCROLLBACK_VRAM
+	sb_view=view;
+	if(view==0){
+		scroll_Snap();
+	}else{
+		s16 row=region_row-view;
+		if(row<0) row+=VRAM_TILES_V;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+			scroll_pending=0;
+			dlist[dlist_region].vramrow=row;
+			dlist[dlist_region].tilerow=0;
+		}
+	}
+#else
+	if(sb_view==0){
+		//park the live screen after the ring
+		for(u8 y=0;y<SCREEN_TILES_V;y++) sb_write(sb_lines+y,&vram[vram_Row(y)*VRAM_TILES_H]);
+	}
+	sb_view=view;
+	for(u8 y=0;y<SCREEN_TILES_V;y++){
+		//history then the live screen, as one list
+		u16 i=sb_count+y-view;
+		u16 row;
+		if(i<sb_count){
+			row=sb_head+sb_lines-sb_count+i;
+			if(row>=sb_lines) row-=sb_lines;
+		}else{
+			row=sb_lines+i-sb_count;
+		}
+		sb_read(row,&vram[vram_Row(y)*VRAM_TILES_H]);
+	}
+#endif
+}
+
+void terminal_VerticalScrollUp(bool clearNewLine){
+	vq_Flush();
+	if(scroll_top_margin==0) scrollback_Capture();
+#if VIDEO_MODE==80
+	if(dlist_split){
+		//the region's entry just moves down its ring
+		u8 speed=smooth_locked?0:smooth_speed;
+		if(speed) while(scroll_Pending());//let the last line finish sliding in
+		u8 top=region_row;
+		u8 next=top+(scroll_bottom_margin-scroll_top_margin)+1;
+		if(next>=VRAM_TILES_V) next-=VRAM_TILES_V;
+		dlist_Evict(next,top);
+		region_row=(top==VRAM_TILES_V-1)?0:top+1;
+		scroll_Animate(TILE_HEIGHT,speed);
+	}else{
+		for(u8 i=scroll_top_margin;i<scroll_bottom_margin;i++){
 			copyLine(i+1,i);
 		}
 	}
+#else
+	//no vram offset in this mode, the region is one contiguous block
+	vram_MoveRows(&vram[scroll_top_margin*VRAM_TILES_H],&vram[(scroll_top_margin+1)*VRAM_TILES_H],
+		(scroll_bottom_margin-scroll_top_margin)*VRAM_TILES_H);
+#endif
+	terminal_ClearLine(scroll_bottom_margin,0,SCREEN_TILES_H-1);
+#if VIDEO_MODE==80
+	terminal_MoveCursor(cx,cy);
+#endif
+}
+
+void terminal_VerticalScrollDown(bool clearNewLine){
+	vq_Flush();
 #if VIDEO_MODE==80
-	if(dlist[0].vramrow == 0){
-		dlist[0].vramrow = SCREEN_TILES_V-1;
+	if(dlist_split){
+		u8 speed=smooth_locked?0:smooth_speed;
+		if(speed) while(scroll_Pending());
+		u8 prev=(region_row==0)?VRAM_TILES_V-1:region_row-1;
+		u8 bottom=region_row+(scroll_bottom_margin-scroll_top_margin);
+		if(bottom>=VRAM_TILES_V) bottom-=VRAM_TILES_V;
+		dlist_Evict(prev,bottom);
+		region_row=prev;
+		scroll_Animate(-TILE_HEIGHT,speed);
 	}else{
-		dlist[0].vramrow--;
+		for(u8 i=scroll_bottom_margin;i>scroll_top_margin;i--){
+			copyLine(i-1,i);
+		}
 	}
+#else
+	vram_MoveRows(&vram[(scroll_top_margin+1)*VRAM_TILES_H],&vram[scroll_top_margin*VRAM_TILES_H],
+		(scroll_bottom_margin-scroll_top_margin)*VRAM_TILES_H);
 #endif
 	if(clearNewLine){
-		terminal_ClearLine(0,0,SCREEN_TILES_H-1);
+		terminal_ClearLine(scroll_top_margin,0,SCREEN_TILES_H-1);
 	}
+#if VIDEO_MODE==80
+	terminal_MoveCursor(cx,cy);
+#endif
+}
+
+bool terminal_SmoothScroll(s16 pixels, u8 speed){
+#if VIDEO_MODE==80
+	if(dlist_count!=1 || !dlist_split) return false;//pinned rows would scroll along
+	scrollback_Live();
+#ifdef SCROLLBACK_VRAM
+	sb_count=0;//the rows wrap around, so there's no history any more
+#endif
+	if(speed==0) speed=1;
+	if(speed>TILE_HEIGHT) speed=TILE_HEIGHT;
+
+	s16 total=region_fine+pixels;
+	s16 rows=total/TILE_HEIGHT;
+	s8 fine=total%TILE_HEIGHT;
+	if(fine<0){
+		fine+=TILE_HEIGHT;
+		rows--;
+	}
+	rows%=VRAM_TILES_V;
+	if(rows<0) rows+=VRAM_TILES_V;
+	region_fine=fine;
+	region_row+=rows;
+	if(region_row>=VRAM_TILES_V) region_row-=VRAM_TILES_V;
+	scroll_Animate(pixels,speed);
+	cursor_Update();
+#else
+	//no fine scrolling in this mode, whole rows only
+	if(scroll_top_margin!=0 || scroll_bottom_margin!=SCREEN_TILES_V-1) return false;
+	if(pixels>-TILE_HEIGHT && pixels<TILE_HEIGHT) return false;
+	for(s16 rows=pixels/TILE_HEIGHT;rows>0;rows--) terminal_VerticalScrollUp(true);
+	for(s16 rows=pixels/TILE_HEIGHT;rows<0;rows++) terminal_VerticalScrollDown(true);
+#endif
+	return true;
+}
+
+void terminal_SetSmoothScroll(u8 speed){
+#if VIDEO_MODE==80
+	smooth_speed=(speed>TILE_HEIGHT)?TILE_HEIGHT:speed;
+#endif
+}
+
+void terminal_LockSmoothScroll(bool lock){
+#if VIDEO_MODE==80
+	smooth_locked=lock;
+#endif
 }
 
 void terminal_SetColors(u8 foreground,u8 background){
 #if VIDEO_MODE==80
-	dlist[0].fgc = foreground;
-	dlist[0].bgc = background;
+	for(u8 i=0;i<DLIST_ENTRIES;i++){
+		dlist[i].fgc = foreground;
+		dlist[i].bgc = background;
+	}
 #endif
 }
 
-void terminal_PutCharAtLoc(u8 x,u8 y, u8 character,u8 attributes){
-	//if inverse attribute is on, use 2nd bank of font which color is inverted
+void terminal_GetState(terminal_state_t *state){
+	vq_Flush();
+	state->cx=cx;
+	state->cy=cy;
 #if VIDEO_MODE==80
-	y+=dlist[0].vramrow;	//Add scrolling offset
+	//store VRAM in screen order
+	dlist_Normalize();
+	dlist_Build();
+	terminal_MoveCursor(cx,cy);
+	state->foreground=dlist[0].fgc;
+	state->background=dlist[0].bgc;
+	state->vramrow=region_row;
+#else
+	state->foreground=foregroudColor;
+	state->background=backgroundColor;
+	state->vramrow=0;
 #endif
-	if(y>=VRAM_TILES_V) y-=VRAM_TILES_V;
+	state->inverse=inverseVideo;
+	state->scroll_top=scroll_top_margin;
+	state->scroll_bottom=scroll_bottom_margin;
+}
+
+void terminal_SetState(const terminal_state_t *state){
+	foregroudColor=state->foreground;
+	backgroundColor=state->background;
+	terminal_SetColors(state->foreground,state->background);
+#if VIDEO_MODE==80
+	scroll_top_margin=0;
+	scroll_bottom_margin=SCREEN_TILES_V-1;
+	dlist_Build();
+	region_row=dlist[0].vramrow=state->vramrow;
+#endif
+	inverseVideo=state->inverse;
+	terminal_SetScrollMargins(state->scroll_top,state->scroll_bottom);
+	terminal_MoveCursor(state->cx,state->cy);
+}
+
+void terminal_PutCharAtLoc(u8 x,u8 y, u8 character,u8 attributes){
+	//if inverse attribute is on, use 2nd bank of font which color is inverted
+	y=vram_Row(y);
 #if VIDEO_MODE==80
-	SetTile(x,y,character-32+(attributes!=0?128:0));
+	u8 tile=character-32+(attributes!=0?128:0);
 #else
-	SetTile(x,y,character-32);
+	u8 tile=character-32;
 #endif
+	if(vq_enabled){
+		vram_Put((y*VRAM_TILES_H)+x,tile);
+	}else{
+		SetTile(x,y,tile);
+	}
 }
 
 u8 	terminal_GetCharAtLoc(u8 x,u8 y){
 #if VIDEO_MODE==80
-	return GetTile(x,y);
+	vq_Flush();
+	return GetTile(x,vram_Row(y));
 #else
 	return 0;
 #endif
 }
 
 void terminal_ClearLine(u8 row, u8 startColumn, u8 endColumn){
-#if VIDEO_MODE==80
-	row+=dlist[0].vramrow;	//Add scrolling offset
-#endif
-	if(row>=VRAM_TILES_V) row-=VRAM_TILES_V;
+	row=vram_Row(row);
 	u16 pos=(row*VRAM_TILES_H)+startColumn;
+	if(vq_enabled){
+		for(u8 i=startColumn;i<=endColumn;i++){
+			vram_Put(pos++,0);
+		}
+		return;
+	}
 	for(u8 i=startColumn;i<=endColumn;i++){
 		vram[pos++]=0;
 	}
 }
 
+#if VRAM_QUEUE_SIZE
 /*
- * Copies the whole row of tiles from a source row to a destination row.
- * Accounts for scrolling offset.
+ * Stores a tile in deferred mode. A cell already in the queue just gets the new
+ * tile, a cell that already shows it isn't queued at all. A full queue is
+ * written out right away, mid-frame or not.
  */
-void copyLine(u8 src, u8 dest){
-#if VIDEO_MODE==80
-	src+=dlist[0].vramrow;	//Add scrolling offset
-#endif
-	if(src>=VRAM_TILES_V) src-=VRAM_TILES_V;
-	u16 srcpos=(src*VRAM_TILES_H);
+static void vram_Put(u16 pos, u8 tile){
+	vq_busy=true;
+	_MemoryBarrier();
+	u8 i=vq_count;
+	while(i--){
+		if(vq_pos[i]==pos){
+			vq_tile[i]=tile;
+			goto done;
+		}
+	}
 #if VIDEO_MODE==80
-	dest+=dlist[0].vramrow;	//Add scrolling offset
+	//the kernel's cursor flips the tile under it during the frame
+	if(vram[pos]==tile && &vram[pos]!=cursor.bakaddr) goto done;
+#else
+	if(vram[pos]==tile) goto done;
 #endif
-	if(dest>=VRAM_TILES_V) dest-=VRAM_TILES_V;
-	u16 destpos=(dest*VRAM_TILES_H);
+	if(vq_count==VRAM_QUEUE_SIZE) vq_Flush();
+	vq_pos[vq_count]=pos;
+	vq_tile[vq_count]=tile;
+	vq_count++;
+done:
+	_MemoryBarrier();
+	vq_busy=false;
+}
 
-	for(u8 i=0;i<=(VRAM_TILES_H-1);i++){
-		vram[destpos++]=vram[srcpos++];
+/*
+ * Writes out everything queued. Called by the vsync callback unless the
+ * program is in the middle of queuing, and by the program before it reads
+ * or moves VRAM.
+ */
+static void vq_Flush(){
+	bool busy=vq_busy;
+	vq_busy=true;
+	_MemoryBarrier();
+	for(u8 i=0;i<vq_count;i++){
+		vram[vq_pos[i]]=vq_tile[i];
 	}
+	vq_count=0;
+	_MemoryBarrier();
+	vq_busy=busy;
+}
+
+#endif
+
+bool terminal_SetDeferredWrites(bool enable){
+#if VRAM_QUEUE_SIZE
+	if(!enable) vq_Flush();
+	vq_enabled=enable;
+	return true;
+#else
+	return !enable;
+#endif
+}
+
+void terminal_FlushWrites(){
+	vq_Flush();
+}
+
+/*
+ * Copies the whole row of tiles from a source row to a destination row.
+ * Accounts for scrolling offset.
+ */
+void copyLine(u8 src, u8 dest){
+	u16 srcpos=(vram_Row(src)*VRAM_TILES_H);
+	u16 destpos=(vram_Row(dest)*VRAM_TILES_H);
+
+	vq_Flush();
+	memcpy(&vram[destpos],&vram[srcpos],VRAM_TILES_H);
 }
 
 
 void terminal_Clear(){
+	scrollback_Live();
+#ifdef SCROLLBACK_VRAM
+	sb_count=0;
+#endif
+#if VRAM_QUEUE_SIZE
+	vq_count=0;
+#endif
 	ClearVram();
 	cx=X_ORIGIN;
 	cy=Y_ORIGIN;
@@ -557,7 +1243,7 @@ void cons_char(unsigned char c){
 			if(cx<SCREEN_TILES_H){
 				terminal_PutCharAtLoc(cx++,cy,c, inverseVideo?TERM_ATTR_INVERSE_VIDEO:0);
 			}else if(DECAWM){
-				if(cy==(SCREEN_TILES_V-1)){
+				if(cy==(scroll_bottom_margin)){
 					terminal_VerticalScrollUp(true);
 				}else{
 					cy++;
@@ -589,381 +1275,354 @@ void cons_char(unsigned char c){
 
 	terminal_MoveCursor(cx,cy);
 }
-//
-///**
-// * Filter to detect supported ANSI Escape sequence. Used to display
-// * bullets and box drawing characters.
-// *
-// * ANSI escape sequences are in the form: ESC[5;20f
-// *
-// * Input: 	c = character to filter
-// * Output:  0 = caller should end filter chain
-// * 			1 = caller should continue with next filter or print the char
-// */
-//bool ansi_filter(u8 c){
-//	if(escaping){
-//		if(is_ansi){
-//			csi_buffer[csi_ptr++]=c;
-//			if(c >= 0x40 && c <= 0x7f){ //received end command marker
-//				//parse the escape sequence
-//				command_line=c;
-//				csi_ptr=0;
-//				csi_param_count=0;
-//				csi_param_ptr=0;
-//				while(1) {
-//					c=csi_buffer[csi_ptr];
-//
-//					if(c == command_line){ //end marker
-//						if(csi_ptr>0){
-//							csi_buffer[csi_ptr]=0; //add string terminator for atoi
-//							csi_params[csi_param_count++]=atoi(csi_buffer+csi_param_ptr);
-//						}else if(csi_param_count>0){
-//							csi_params[csi_param_count++]=0xff;	//empty param marker
-//						}
-//						break;
-//					}else if(c==';'){		//param separator
-//						if(csi_ptr>0){
-//							csi_buffer[csi_ptr]=0; //add string terminator for atoi
-//							csi_params[csi_param_count++]=atoi(csi_buffer+csi_param_ptr);
-//						}else{
-//							csi_params[csi_param_count++]=0xff;	//empty param marker
-//						}
-//						csi_param_ptr=csi_ptr+1;
-//					}else if(c=='?'){
-//						csi_param_ptr+=1;
-//						csi_extension=true;
-//					}
-//
-//					csi_ptr++;
-//				};
-//
-//				switch(c){
-//					case 'A':			//move up one line, stop at top of screen
-//						if(csi_param_count==0){
-//							if(cy>Y_ORIGIN) cy--;
-//							}else{
-//							cy-=csi_params[0];
-//						}
-//						terminal_MoveCursor(cx,cy);
-//						break;
-//
-//					case 'B':			//move down one line, stop at bottom of screen
-//						if(csi_param_count==0){
-//							if(cy<(SCREEN_TILES_V-1)) cy++;
-//							}else{
-//							cy+=csi_params[0];
-//						}
-//						terminal_MoveCursor(cx,cy);
-//						break;
-//
-//					case 'C':			//move forward one position, stop at right edge of screen
-//						if(csi_param_count==0){
-//							cx++;
-//							}else{
-//							cx+=csi_params[0];
-//						}
-//						if(cx>=SCREEN_TILES_H)cx=(SCREEN_TILES_H-1);
-//						terminal_MoveCursor(cx,cy);
-//						break;
-//
-//					case 'D':			//move backwards one position, Same as BackSpace, stop at left edge of screen
-//
-//						if(csi_param_count==0){
-//							if(cx>X_ORIGIN) cx--;
-//							}else{
-//							cx-=csi_params[0];
-//						}
-//						terminal_MoveCursor(cx,cy);
-//						break;
-//
-//					case 'd': //vertical Position Absolute
-//						break;
-//
-//					case 'g': //tabulation Clear
-//						//needed for lynx - ESC[3g on Scramworks
-//						break;
-//
-//					case 'G': //horizontal absolute tab. Moves the cursor to column n (default 1).
-//						//needed for lynx on Scramworks
-//						break;
-//
-//					case 'h':
-//						if(csi_extension){
-//							if(csi_params[0]==25){	//Show cursor
-//								terminal_SetCursorVisible(true);
-//								}else if(csi_params[0]==7){					//DECAWM - AutoWrap Mode, start newline after column 80
-//								DECAWM=true;
-//								}else if(csi_params[0]==1){					//DECCKMCursor Keys Mode
-//								DECCKM=true;
-//							}
-//						}
-//						break;
-//
-//					case 'H':					//cursor position -- All cases covered
-//					case 'f':
-//						if(csi_param_count==0){
-//							//no coordinates,move to origin
-//							 //console_SetCursor(CONS_X_ORIGIN,CONS_Y_ORIGIN);
-//							 cx=X_ORIGIN;
-//							 cy=Y_ORIGIN;
-//						}else{
-//
-//							if(csi_params[0]==0xff){
-//								cy=Y_ORIGIN;
-//							}else{
-//								cy=csi_params[0];
-//								if(cy==0) cy=1;
-//								cy= cy - 1 + Y_ORIGIN;
-//							}
-//							if(csi_params[1]==0xff){
-//								cx=X_ORIGIN;
-//							}else{
-//								cx=csi_params[1];
-//								if(cx==0) cx=1;
-//								cx= cx - 1 + X_ORIGIN;
-//							}
-//
-//							//clip
-//							if(cy>=SCREEN_TILES_V)cy=SCREEN_TILES_V-1; //row
-//							if(cx>=SCREEN_TILES_H)cx=SCREEN_TILES_H-1; //column
-//
-//						}
-//						terminal_MoveCursor(cx,cy);
-//						break;
-//
-//					case 'J':	// erase display
-//						//[0J     erase from current position to bottom of screen inclusive
-//						//[1J     erase from top of screen to current position inclusive
-//						//[2J     erase entire screen (without moving the cursor)
-//						ClearVram(); //All cases erases the whole screen
-//						break;
-//
-//					case 'K':	//erase a line
-//						if(csi_param_count==0 || (csi_param_count>0 && csi_params[0]==0)) {
-//							//clear line from cursor to end of line (same as [K )
-//							terminal_ClearLine(cy,cx,SCREEN_TILES_H-1);
-//
-//							}else if(csi_params[0]==1){
-//							//clear line beginning to cursor
-//							terminal_ClearLine(cy,0,cx);
-//
-//							}else if(csi_params[0]==2){
-//							//clear entire line
-//							terminal_ClearLine(cy,0,SCREEN_TILES_H-1);
-//						}
-//						break;
-//
-//					case 'l':	//reset mode
-//						if(csi_extension){
-//							if(csi_params[0]==25){ 	//### hide cursor
-//								terminal_SetCursorVisible(false);
-//								}else if(csi_params[0]==7){					//DECAWM - AutoWrap Mode, start newline after column 80
-//								DECAWM=false;
-//								}else if(csi_params[0]==1){					//DECCKMCursor Keys Mode
-//								DECCKM=false;
-//							}
-//						}
-//						break;
-///*ansi mode only
-//					case 'L':	//Insert lines
-//
-//						if(cy==Y_ORIGIN){ //currently only supports inserting from top of screen
-//							u8 lines=1;
-//							if(csi_param_count==1) lines=csi_params[0];
-//							for(u8 i=0;i<lines;i++){
-//								terminal_VerticalScrollDown(true);
-//							}
-//						}
-//						break;
-//*/
-//					case 'm':	//graphics mode related
-//						if(csi_param_count==0){
-//							inverseVideo=false;
-//						}else{
-//							//iterate params to apply attributes
-//							for(u8 i=0;i<csi_param_count;i++){
-//								if(csi_params[i]==0){
-//									inverseVideo=false;
-//								}else if(csi_params[i]==7){
-//									inverseVideo=true;
-//								}
-//							}
-//						}
-//
-//						break;
-///* ansi mode only
-//					case 'M':	//Delete lines
-//
-//						if(cy==Y_ORIGIN){ //currently only supports deleting from top of screen
-//							u8 lines=1;
-//							if(csi_param_count==1) lines=csi_params[0];
-//							for(u8 i=0;i<lines;i++){
-//								terminal_VerticalScrollUp(true);
-//							}
-//						}
-//						break;
-//*/
-//					case 'P':	//delete n Characters, from current position to end of field
-//
-//						if(csi_param_count==0 || (csi_param_count>0 && csi_params[0]==1)){
-//							if(cx>X_ORIGIN){
-//								for(u8 x=cx;x<SCREEN_TILES_H;x++){
-//									c=terminal_GetCharAtLoc(x+1,cy);
-//									terminal_PutCharAtLoc(x,cy,c,0);
-//								}
-//								terminal_PutCharAtLoc(SCREEN_TILES_H-1,cy,' ',0);
-//							}
-//						}else{
-//							printf(" ESC[");
-//							for(int i=0;i<esc_pos;i++){
-//								putchar(escape_buf[i]);
-//							}
-//						}
-//						break;
-//
-//					case 'r':	//top and bottom margins (scroll region on VT100).
-//						scroll_top_margin=csi_params[0]-1;
-//						scroll_bottom_margin=csi_params[1]-1;
-//						break;
-//
-//					case 'S':	//scroll up
-//						terminal_VerticalScrollUp(true);
-//						break;
-//
-//					case 'T':	//scroll down
-//						terminal_VerticalScrollDown(true);
-//						break;
-//
-//					default:
-//						break;
-//				}
-//
-//				//done!
-//				escaping=false;
-//
-//			}
-//		}else if(c=='['){
-//			is_ansi=true;
-//			csi_ptr=0;
-//		}else{
-//			//unsupported non-ansi stuff
-//
-//			if(c=='D'){ //(VT100) index IND - Move/scroll window up one line
-//				terminal_VerticalScrollUp(true);
-//			}else if(c=='M'){	//(VT100) revindex RI - Move/scroll window down one line
-//				terminal_VerticalScrollDown(true);
-//			}
-//
-//			escaping=false;
-//		}
-//	}else{
-//		if(c==27){
-//			escaping=true;
-//			is_ansi=false;
-//			return false;
-//		}else{
-//			return true;
-//		}
-//
-//	}
-//
-//	return false;
-//}
-//
-//
-///**
-// * Filter to detect UTF8 sequences. Principally used to detect extended characters like bullets and box drawing symbols.
-// * Input: c = character to filter
-// * Output:  0 = caller should end filter chain
-// * 			1 = caller should continue with next filter or print the char
-// */
-//bool utf8_seq=false;	//indicates we are in utf8 sequence
-//u8 bytes[4]; 			//Incoming data bytes, b1 comes first
-//u8 utf8_lenght;			//length of sequence
-//u8 utf8_curr;			//current byte
-//bool utf8_filter(u8 c){
-//
-//	if(utf8_seq==false && (c&0x80)){ //check if beginning of utf-8
-//		if((c&0b11100000)==0b11000000){ //2-bytes UTF-8 character detected
-//			utf8_lenght=2;
-//		}else if((c&0b11110000)==0b11100000){ //3-bytes UTF-8 character detected
-//			utf8_lenght=3;
-//		}else if((c&0b11111000)==0b11110000){ //4-bytes UTF-8 character detected
-//			utf8_lenght=4;
-//		}else{
-//			cons_char(128); 	//square symbol - unsupported characters
-//			return false;	//no sequence
-//		}
-//		utf8_seq=true;
-//		utf8_curr=0;
-//		bytes[utf8_curr++]=c;
-//
-//	}else if(utf8_seq){
-//		u8 utf_char=128;//'?';
-//
-//		bytes[utf8_curr++]=c;		//store next byte in sequence
-//		if(utf8_curr<utf8_lenght) return false;	//wait for more chars
-//
-//		if(utf8_lenght==2){		//2 bytes char
-//			if(bytes[0]==0xc2 && bytes[1]==0xa0){
-//				utf_char=' '; //non-breakable space (&nbsp);
-//			}
-//		}else if(utf8_lenght==3){	//3 bytes char
-//			if(bytes[0]==0xe2){
-//				if(bytes[1]==0x80 && bytes[2]==0xa2){	//Bullet
-//					utf_char=127;
-//				}else if (bytes[1]==0x80 && bytes[2]==0x93){
-//					utf_char='-'; 			//long dash
-//				}else if (bytes[1]==0x94){		//Box drawing tiles
-//
-//					switch(bytes[2]){
-//						case 0x82:
-//							utf_char=0x86;	//134:  |   Vertical line
-//							break;
-//						case 0x8c:
-//							utf_char=0x81; 	//129:  __  Corner facing down+right
-//							break;			//     |
-//						case 0x80:
-//							utf_char=0x85;	//133: ---  Horizontal line
-//							break;
-//						case 0x90:
-//							utf_char=0x82; 	//130: __   Corner facing down+left
-//							break;			//       |
-//						case 0x94:
-//							utf_char=0x83; 	//131: |    Corner facing up+right corner
-//							break;			//      --
-//						case 0x98:
-//							utf_char=0x84;	//132:    | Corner facing up+left corner
-//							break;			//      --
-//						case 0x9c:
-//							utf_char=0x87;	//135:  |-
-//							break;
-//						case 0xa4:
-//							utf_char=0x88;	//136: -|
-//							break;
-//						case 0xb4:
-//							utf_char=0x89;	//137:  |
-//							break;			//     ---
-//						case 0xac:
-//							utf_char=0x8A;	//138: ---
-//							break;			//      |
-//						case 0xbc:
-//							utf_char=0x8B;	//139: -|-
-//							break;
-//						default:
-//							utf_char=0x80; //undefined
-//							break;
-//					}
-//				}
-//			}
-//		}	//if it was 4 bytes utf8 sequence, we do nothing
-//
-//		cons_char(utf_char);
-//		utf8_seq=false;
-//
-//	}else{
-//		return true; //possibly a normal printable character
-//	}
-//
-//	return false;
-//}
+
+/*
+ * Filter for ANSI/VT100 escape sequences. Runs one byte at a time: parameters
+ * are accumulated as the digits arrive and the final byte of a CSI sequence
+ * indexes straight into csi_table[], so nothing is buffered or re-parsed.
+ *
+ * ANSI escape sequences are in the form: ESC[5;20f
+ *
+ * Input: 	c = character to filter
+ * Output:  0 = caller should end filter chain
+ * 			1 = caller should continue with next filter or print the char
+ */
+
+//Parameter value, or def if it was missing or 0
+static u8 csi_Param(u8 i, u8 def){
+	return (i<csi_count && csi_params[i]!=0)?csi_params[i]:def;
+}
+
+static void csi_CursorUp(){		//A
+	u8 n=csi_Param(0,1);
+	cy=(cy>=n)?cy-n:0;
+}
+
+static void csi_CursorDown(){	//B
+	u8 n=csi_Param(0,1);
+	cy=(cy+n>=SCREEN_TILES_V)?SCREEN_TILES_V-1:cy+n;
+}
+
+static void csi_CursorForward(){	//C
+	u8 n=csi_Param(0,1);
+	cx=(cx+n>=SCREEN_TILES_H)?SCREEN_TILES_H-1:cx+n;
+}
+
+static void csi_CursorBack(){	//D
+	u8 n=csi_Param(0,1);
+	cx=(cx>=n)?cx-n:0;
+}
+
+static void csi_Column(){		//G - horizontal absolute
+	cx=csi_Param(0,1)-1;
+	if(cx>=SCREEN_TILES_H) cx=SCREEN_TILES_H-1;
+}
+
+static void csi_Row(){			//d - vertical position absolute
+	cy=csi_Param(0,1)-1;
+	if(cy>=SCREEN_TILES_V) cy=SCREEN_TILES_V-1;
+}
+
+static void csi_Position(){		//H,f
+	csi_Row();
+	cx=csi_Param(1,1)-1;
+	if(cx>=SCREEN_TILES_H) cx=SCREEN_TILES_H-1;
+}
+
+/*
+ * Cursor column for the editing sequences. After a full line or a TAB, cx can
+ * sit on or past the right edge, the cursor is then on the last column.
+ */
+static u8 csi_CursorColumn(){
+	return (cx<SCREEN_TILES_H)?cx:SCREEN_TILES_H-1;
+}
+
+static void csi_EraseDisplay(){	//J - 0:cursor to end, 1:start to cursor, 2:all
+	u8 mode=csi_Param(0,0);
+	u8 x=csi_CursorColumn();
+	for(u8 y=0;y<SCREEN_TILES_V;y++){
+		if(y==cy && mode!=2){
+			if(mode==0)
+				terminal_ClearLine(y,x,SCREEN_TILES_H-1);
+			else
+				terminal_ClearLine(y,0,x);
+		}else if(mode==2 || (mode==0 && y>cy) || (mode==1 && y<cy)){
+			terminal_ClearLine(y,0,SCREEN_TILES_H-1);
+		}
+	}
+}
+
+static void csi_EraseLine(){		//K - 0:cursor to end, 1:start to cursor, 2:all
+	u8 mode=csi_Param(0,0);
+	u8 x=csi_CursorColumn();
+	if(mode==0){
+		terminal_ClearLine(cy,x,SCREEN_TILES_H-1);
+	}else if(mode==1){
+		terminal_ClearLine(cy,0,x);
+	}else if(mode==2){
+		terminal_ClearLine(cy,0,SCREEN_TILES_H-1);
+	}
+}
+
+static void csi_Mode(bool set){
+	if(!csi_private) return;
+	for(u8 i=0;i<csi_count && i<CSI_MAX_PARAMS;i++){
+		switch(csi_params[i]){
+			case 1:		//DECCKM - Cursor Keys Mode
+				DECCKM=set;
+				break;
+			case 4:		//DECSCLM - smooth scroll
+#if VIDEO_MODE==80
+				if(!smooth_locked)
+#endif
+					terminal_SetSmoothScroll(set?1:0);
+				break;
+			case 7:		//DECAWM - AutoWrap Mode, start newline after column 80
+				DECAWM=set;
+				break;
+			case 25:	//show/hide cursor
+				terminal_SetCursorVisible(set);
+				break;
+		}
+	}
+}
+
+static void csi_SetMode(){		//h
+	csi_Mode(true);
+}
+
+static void csi_ResetMode(){	//l
+	csi_Mode(false);
+}
+
+static void csi_Attributes(){	//m - graphics mode related
+	if(csi_count==0) inverseVideo=false;
+	for(u8 i=0;i<csi_count && i<CSI_MAX_PARAMS;i++){
+		if(csi_params[i]==0 || csi_params[i]==27){
+			inverseVideo=false;
+		}else if(csi_params[i]==7){
+			inverseVideo=true;
+		}
+	}
+}
+
+static void csi_DeleteChars(){	//P - delete n characters, the rest of the line moves left
+	u8 n=csi_Param(0,1);
+	u8 x=csi_CursorColumn();
+	if(n>SCREEN_TILES_H-x) n=SCREEN_TILES_H-x;
+	u8 *p=&vram[(vram_Row(cy)*VRAM_TILES_H)+x];
+	vq_Flush();
+	memmove(p,p+n,SCREEN_TILES_H-x-n);
+	terminal_ClearLine(cy,SCREEN_TILES_H-n,SCREEN_TILES_H-1);
+}
+
+static void csi_Margins(){		//r - top and bottom margins (scroll region on VT100)
+	u8 top=csi_Param(0,1)-1;
+	u8 bottom=csi_Param(1,SCREEN_TILES_V)-1;
+	if(bottom>=SCREEN_TILES_V) bottom=SCREEN_TILES_V-1;
+	if(top>=bottom) return;
+	terminal_SetScrollMargins(top,bottom);
+	cx=X_ORIGIN;
+	cy=Y_ORIGIN;
+}
+
+static void csi_ScrollUp(){		//S
+	for(u8 n=csi_Param(0,1);n;n--) terminal_VerticalScrollUp(true);
+}
+
+static void csi_ScrollDown(){	//T
+	for(u8 n=csi_Param(0,1);n;n--) terminal_VerticalScrollDown(true);
+}
+
+//Handlers indexed by the final byte of the sequence, less 0x40
+typedef void (*csi_handler_t)();
+static const csi_handler_t csi_table[0x3f] PROGMEM={
+	['A'-0x40]=csi_CursorUp,
+	['B'-0x40]=csi_CursorDown,
+	['C'-0x40]=csi_CursorForward,
+	['D'-0x40]=csi_CursorBack,
+	['G'-0x40]=csi_Column,
+	['H'-0x40]=csi_Position,
+	['J'-0x40]=csi_EraseDisplay,
+	['K'-0x40]=csi_EraseLine,
+	['P'-0x40]=csi_DeleteChars,
+	['S'-0x40]=csi_ScrollUp,
+	['T'-0x40]=csi_ScrollDown,
+	['d'-0x40]=csi_Row,
+	['f'-0x40]=csi_Position,
+	['h'-0x40]=csi_SetMode,
+	['l'-0x40]=csi_ResetMode,
+	['m'-0x40]=csi_Attributes,
+	['r'-0x40]=csi_Margins,
+};
+
+/*
+ * Two byte sequences, ESC followed by c.
+ */
+static void esc_Dispatch(u8 c){
+	switch(c){
+		case 'E':	//(VT100) next line NEL
+			cx=X_ORIGIN;
+			//fall through
+		case 'D':	//(VT100) index IND - Move/scroll window up one line
+			if(cy==scroll_bottom_margin){
+				terminal_VerticalScrollUp(true);
+			}else if(cy<SCREEN_TILES_V-1){
+				cy++;
+			}
+			break;
+		case 'M':	//(VT100) revindex RI - Move/scroll window down one line
+			if(cy==scroll_top_margin){
+				terminal_VerticalScrollDown(true);
+			}else if(cy>0){
+				cy--;
+			}
+			break;
+		case '7':	//save cursor
+			save_cx=cx;
+			save_cy=cy;
+			break;
+		case '8':	//restore cursor
+			cx=save_cx;
+			cy=save_cy;
+			break;
+	}
+}
+
+bool ansi_filter(u8 c){
+	if(ansi_state==ANSI_GROUND){
+		if(c!=27) return true;
+		ansi_state=ANSI_ESC;
+		return false;
+	}
+
+	if(c==27){					//ESC always starts over
+		ansi_state=ANSI_ESC;
+	}else if(c==24 || c==26){	//CAN, SUB abort the sequence
+		ansi_state=ANSI_GROUND;
+	}else if(ansi_state==ANSI_STRING){
+		if(c==7) ansi_state=ANSI_GROUND;	//BEL ends it, so does ST, ESC and a backslash, as ESC starts over above
+	}else if(ansi_state==ANSI_ESC_INT){
+		if(c>=0x30 && c<=0x7e) ansi_state=ANSI_GROUND;	//character set designators, ignored
+	}else if(ansi_state==ANSI_ESC){
+		if(c=='['){
+			ansi_state=ANSI_CSI;
+			csi_private=false;
+			csi_count=0;
+		}else if(c>=0x20 && c<=0x2f){
+			ansi_state=ANSI_ESC_INT;
+		}else if(c==']' || c=='P' || c=='X' || c=='^' || c=='_'){
+			ansi_state=ANSI_STRING;
+		}else if(c<32){
+			cons_char(c);
+		}else{
+			ansi_state=ANSI_GROUND;
+			esc_Dispatch(c);
+			terminal_MoveCursor(cx,cy);
+		}
+	}else if(c>='0' && c<='9'){
+		if(csi_count==0) csi_params[csi_count++]=0;
+		u8 *p=&csi_params[csi_count-1];
+		u16 v=(*p*10)+(c-'0');
+		*p=(v>255)?255:v;
+	}else if(c==';'){
+		if(csi_count==0) csi_params[csi_count++]=0;	//empty first parameter
+		if(csi_count<=CSI_MAX_PARAMS) csi_count++;	//extra ones all land in the spare slot
+		csi_params[csi_count-1]=0;
+	}else if(c=='?'){
+		csi_private=true;
+	}else if(c>=0x40 && c<=0x7e){	//final byte
+		ansi_state=ANSI_GROUND;
+		csi_handler_t handler=(csi_handler_t)pgm_read_word(&csi_table[c-0x40]);
+		if(handler!=NULL){
+			handler();
+			terminal_MoveCursor(cx,cy);
+		}
+	}else if(c<32){					//control characters still act inside a sequence
+		cons_char(c);
+	}
+	return false;
+}
+
+/*
+ * Filter for UTF-8 sequences, principally used to show bullets and box drawing
+ * symbols. Bytes are run through a DFA (after Bjoern Hoehrmann's decoder) so each
+ * one costs two table reads whatever the sequence, then the finished code point
+ * is looked up in PROGMEM tables. A byte that can't start a sequence is left
+ * alone and printed as the tile it indexes, so CHR$(128) and up still work.
+ *
+ * Input: 	c = character to filter
+ * Output:  0 = caller should end filter chain
+ * 			1 = caller should continue with next filter or print the char
+ */
+
+//Character class of bytes 0x80-0xff, 0x00-0x7f are all class 0
+static const u8 utf8_classes[128] PROGMEM={
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+	7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+	8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+	10,3,3,3,3,3,3,3,3,3,3,3,3,4,3,3, 11,6,6,6,5,8,8,8,8,8,8,8,8,8,8,8,
+};
+
+//Next state, indexed by state+class
+static const u8 utf8_states[108] PROGMEM={
+	0,12,24,36,60,96,84,12,12,12,48,72, 12,12,12,12,12,12,12,12,12,12,12,12,
+	12, 0,12,12,12,12,12, 0,12, 0,12,12, 12,24,12,12,12,12,12,24,12,24,12,12,
+	12,12,12,12,12,12,12,24,12,12,12,12, 12,24,12,12,12,12,12,12,12,24,12,12,
+	12,12,12,12,12,12,12,36,12,36,12,12, 12,36,12,12,12,12,12,36,12,36,12,12,
+	12,36,12,12,12,12,12,12,12,12,12,12,
+};
+
+//Characters for U+2500-U+257F, light, heavy, double and rounded lines all share the same tiles. 0: none
+static const u8 utf8_box[128] PROGMEM={
+	0x85,0x85,0x86,0x86,0x85,0x85,0x86,0x86,0x85,0x85,0x86,0x86,0x81,0x81,0x81,0x81,	//U+2500
+	0x82,0x82,0x82,0x82,0x83,0x83,0x83,0x83,0x84,0x84,0x84,0x84,0x87,0x87,0x87,0x87,	//U+2510
+	0x87,0x87,0x87,0x87,0x88,0x88,0x88,0x88,0x88,0x88,0x88,0x88,0x8a,0x8a,0x8a,0x8a,	//U+2520
+	0x8a,0x8a,0x8a,0x8a,0x89,0x89,0x89,0x89,0x89,0x89,0x89,0x89,0x8b,0x8b,0x8b,0x8b,	//U+2530
+	0x8b,0x8b,0x8b,0x8b,0x8b,0x8b,0x8b,0x8b,0x8b,0x8b,0x8b,0x8b,0x85,0x85,0x86,0x86,	//U+2540
+	0x85,0x86,0x81,0x81,0x81,0x82,0x82,0x82,0x83,0x83,0x83,0x84,0x84,0x84,0x87,0x87,	//U+2550
+	0x87,0x88,0x88,0x88,0x8a,0x8a,0x8a,0x89,0x89,0x89,0x8b,0x8b,0x8b,0x81,0x82,0x84,	//U+2560
+	0x83,0x00,0x00,0x00,0x85,0x86,0x85,0x86,0x85,0x86,0x85,0x86,0x85,0x86,0x85,0x86,	//U+2570
+};
+
+//Code points outside of the box drawing block
+static const struct{
+	u16 cp;
+	u8 c;
+} utf8_misc[] PROGMEM={
+	{0x00a0,' '},	//non-breakable space (&nbsp)
+	{0x2013,'-'},	//en dash
+	{0x2014,'-'},	//em dash
+	{0x2022,127},	//bullet
+};
+
+static u8 utf8_Char(u32 cp){
+	if(cp>=0x2500 && cp<0x2580){
+		u8 c=pgm_read_byte(&utf8_box[cp-0x2500]);
+		if(c) return c;
+	}else{
+		for(u8 i=0;i<sizeof(utf8_misc)/sizeof(utf8_misc[0]);i++){
+			if(pgm_read_word(&utf8_misc[i].cp)==cp) return pgm_read_byte(&utf8_misc[i].c);
+		}
+	}
+	return UTF8_UNKNOWN;
+}
+
+bool utf8_filter(u8 c){
+	if(utf8_state==UTF8_ACCEPT && c<0x80) return true;
+
+	u8 type=(c<0x80)?0:pgm_read_byte(&utf8_classes[c-0x80]);
+	bool start=(utf8_state==UTF8_ACCEPT);
+	utf8_codep=start?(0xff>>type)&c:(c&0x3f)|(utf8_codep<<6);
+	utf8_state=pgm_read_byte(&utf8_states[utf8_state+type]);
+
+	if(utf8_state==UTF8_ACCEPT){
+		cons_char(utf8_Char(utf8_codep));
+	}else if(utf8_state==UTF8_REJECT){
+		utf8_state=UTF8_ACCEPT;
+		if(start || c<0x80) return true;	//not UTF-8 at all, print it as is
+		cons_char(UTF8_UNKNOWN);			//broken sequence
+		return c<0x80;
+	}
+	return false;
+}
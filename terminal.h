@@ -86,17 +86,15 @@ extern const char ESC_KEY_F1[];
 #define TB_CDR 	"\xe2\x94\x8c"  //Corner facing down+right
 #define TB_HOR	"\xe2\x94\x80"	//Horizontal line
 #define TB_CDL	"\xe2\x94\x90"	//Corner facing down+left
-/*
-
-							utf_char=0x82; 	//130: __   Corner facing down+left
-							utf_char=0x83; 	//131: |    Corner facing up+right corner
-							utf_char=0x84;	//132:    | Corner facing up+left corner
-							utf_char=0x87;	//135:  |-
-							utf_char=0x88;	//136: -|
-							utf_char=0x89;	//137:  |
-							utf_char=0x8A;	//138: ---
-							utf_char=0x8B;	//139: -|-
-*/
+#define TB_CUR	"\xe2\x94\x94"	//Corner facing up+right
+#define TB_CUL	"\xe2\x94\x98"	//Corner facing up+left
+#define TB_TR	"\xe2\x94\x9c"	//Tee facing right |-
+#define TB_TL	"\xe2\x94\xa4"	//Tee facing left -|
+#define TB_TD	"\xe2\x94\xac"	//Tee facing down
+#define TB_TU	"\xe2\x94\xb4"	//Tee facing up
+#define TB_CRS	"\xe2\x94\xbc"	//Cross -|-
+#define TB_BUL	"\xe2\x80\xa2"	//Bullet
+#define TB_DSH	"\xe2\x80\x93"	//Dash
 
 /*
  * Sets text attributes.
@@ -145,6 +143,12 @@ extern bool terminal_HasChar();
  */
 extern u8	terminal_GetChar();
 
+/*
+ * Number of keys dropped because the program didn't read them
+ * before the transmit buffer filled up.
+ */
+extern u16	terminal_GetOverflowCount();
+
 /*
  * Sends a characters to the terminal's receiver and video display.
  * stdio functions like printf and putc can also be used
@@ -152,6 +156,12 @@ extern u8	terminal_GetChar();
  */
 extern void terminal_SendChar(u8 c);
 
+/*
+ * Sends a run of characters to the video display. Much cheaper than
+ * terminal_SendChar() per character for printable text.
+ */
+extern void terminal_WriteSpan(const u8 *s, u16 len);
+
 /**
  * Append a char to the transmit buffer. This helper function
  * can be used to simulate a keystroke by the host.
@@ -201,28 +211,95 @@ extern void terminal_SetVerticalScroll(u8 row);
 extern u8	terminal_GetVerticalScroll();
 
 /**
- * Set the top and bottom scroll margins.
+ * Set the top and bottom scroll margins. Rows outside of them
+ * stay put when the region scrolls.
  */
 extern void terminal_SetScrollMargins(u8 top, u8 bottom);
 
 /**
- * Scrolls up the entire screen up by one line.
+ * Scrolls the region between the scroll margins up by one line.
  * Set clearNewLine = true to clear the new line that appears
- * at the bottom of the screen.
+ * at the bottom of the region.
  */
 extern void terminal_VerticalScrollUp(bool clearNewLine);
 /**
- * Scrolls up the entire screen down by one line.
+ * Scrolls the region between the scroll margins down by one line.
  * Set clearNewLine = true to clear the new line that appears
- * at the top of the screen.
+ * at the top of the region.
  */
 extern void terminal_VerticalScrollDown(bool clearNewLine);
 
+/**
+ * Scrolls the screen by a number of pixels, positive is up. In video mode 80
+ * rows wrap around rather than being cleared and the call returns right away,
+ * the vsync callback moves the display list's tilerow at speed pixels per
+ * frame. Other modes scroll whole rows at once like a line feed does: the new
+ * rows are cleared, rows leaving the top go to scrollback, and any remainder
+ * of pixels/TILE_HEIGHT is dropped.
+ * Returns false if scroll margins pin any rows, or in modes other than 80 if
+ * pixels is less than one row.
+ */
+extern bool terminal_SmoothScroll(s16 pixels, u8 speed);
+
+/**
+ * Sets how many pixels per frame terminal output scrolls by, 0 scrolls
+ * a whole line at once. Video mode 80 only.
+ */
+extern void terminal_SetSmoothScroll(u8 speed);
+
+/**
+ * While locked, output scrolls a whole line at once and DECSCLM from the host is
+ * ignored. For hosts that can't be held off while a line slides in.
+ */
+extern void terminal_LockSmoothScroll(bool lock);
+
+/**
+ * Sets where rows scrolling off the top of the screen are kept, VRAM_TILES_H bytes
+ * each. Rows 0 to lines-1 are the history, lines to lines+SCREEN_TILES_V-1 hold the
+ * live screen while history is shown. Not used in video mode 80 builds with more
+ * VRAM rows than screen rows, the spare rows are the history there.
+ */
+extern void terminal_SetScrollback(u16 lines, void (*write)(u16 row, const u8 *tiles), void (*read)(u16 row, u8 *tiles));
+
+/**
+ * Moves the view into the scrollback by a number of rows, positive goes back
+ * in time. PgUp/PgDn page through it, any output returns to the live screen.
+ */
+extern void terminal_ScrollbackView(s16 rows);
+
+/**
+ * Deferred mode queues every tile written and stores them all in the next
+ * vertical blank, so animation doesn't tear. A cell written several times in a
+ * frame is only stored once. Turning it off writes out anything still queued.
+ * Only built in with -DVRAM_QUEUE_SIZE=n, returns false when asked to turn it on otherwise.
+ */
+extern bool terminal_SetDeferredWrites(bool enable);
+
+/**
+ * Writes out the deferred mode queue now. Needed before touching VRAM directly.
+ */
+extern void terminal_FlushWrites();
+
 /**
  * Define the foreground and background colors of the terminal's display.
  */
 extern void terminal_SetColors(u8 foreground,u8 background);
 
+/**
+ * Cursor, colors, attributes and scrolling, everything but VRAM itself.
+ * Used to save and restore the display along with a program.
+ */
+typedef struct{
+	u8 cx,cy;
+	u8 foreground,background;
+	u8 inverse;
+	u8 scroll_top,scroll_bottom;
+	u8 vramrow;
+} terminal_state_t;
+
+extern void terminal_GetState(terminal_state_t *state);
+extern void terminal_SetState(const terminal_state_t *state);
+
 /**
  * Writes the specified characters, at the specified location on the screen.
  * If attributes is non-zero, the text will be inverted.
@@ -0,0 +1,335 @@
+/*
+**  Packs data files into a single indexed archive for UzeBASIC (PAK/PLOAD).
+**
+**  Usage: uzepak [-a alignment] [-c] archive.pak file1 [file2 ...]
+**         uzepak -z input output
+**
+**  -c compresses every entry that gets smaller, except .BAS and .BIN programs
+**  which PLOAD loads in place. -z compresses a single file for DLOAD. Compressed data starts with 0xB5 'Z', a method byte (1 RLE,
+**  2 LZ4 block format) and the u32 unpacked size. The interpreter detects
+**  it and unpacks while reading, using the destination as the window.
+**  Because of that a raw file must not start with 0xB5 'Z' followed by 1
+**  or 2: it would be taken as packed, and refused if the size field
+**  doesn't fit the destination. uzepak warns about such files.
+**
+**  RLE control bytes: 0..127 copy that many plus one literals, 128..255
+**  repeat the next byte (control-125) times.
+**
+**  Layout, all values little endian:
+**
+**    header   "UZPK", u16 version, u16 entry count
+**    index    count entries of { char name[16], u32 offset, u32 size },
+**             sorted by name so the interpreter can binary search it
+**    payloads each starting on a multiple of the alignment (512 by default,
+**             one SD sector) so a small entry never straddles two sectors
+**
+**  Entry names are the file names without any directory, upper cased, at
+**  most 15 characters.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#define PAK_VERSION		1
+#define PAK_NAME_LEN	16
+#define PAK_HEADER_SIZE	8
+#define PAK_ENTRY_SIZE	(PAK_NAME_LEN+4+4)
+
+#define PACK_MAGIC0		0xB5
+#define PACK_MAGIC1		'Z'
+#define PACK_RLE		1
+#define PACK_LZ4		2
+#define PACK_HEADER_SIZE	7
+
+#define RLE_MIN_RUN		3
+#define RLE_MAX_RUN		130
+#define RLE_MAX_LIT		128
+
+#define LZ4_MIN_MATCH	4
+#define LZ4_MAX_OFFSET	65535
+#define LZ4_HASH_BITS	12
+
+typedef struct{
+	char name[PAK_NAME_LEN];
+	const char *path;
+	uint8_t *data;
+	uint32_t offset;
+	uint32_t size;
+}entry_t;
+
+static void put16(FILE *f, uint16_t v){
+	fputc(v & 0xFF, f);
+	fputc(v >> 8, f);
+}
+
+static void put32(FILE *f, uint32_t v){
+	put16(f, v & 0xFFFF);
+	put16(f, v >> 16);
+}
+
+static uint8_t *load_file(const char *path, uint32_t *size){
+	FILE *in = fopen(path, "rb");
+	if(in == NULL){
+		perror(path);
+		exit(1);
+	}
+	fseek(in, 0, SEEK_END);
+	*size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	uint8_t *data = malloc(*size ? *size : 1);
+	if(data == NULL || fread(data, 1, *size, in) != *size){
+		fprintf(stderr, "uzepak: can't read %s\n", path);
+		exit(1);
+	}
+	fclose(in);
+	return data;
+}
+
+static uint32_t rle_pack(const uint8_t *src, uint32_t len, uint8_t *dst){
+	uint32_t i = 0, o = 0;
+	while(i < len){
+		uint32_t run = 1;
+		while(i+run < len && run < RLE_MAX_RUN && src[i+run] == src[i])
+			run++;
+		if(run >= RLE_MIN_RUN){
+			dst[o++] = run+125;
+			dst[o++] = src[i];
+			i += run;
+			continue;
+		}
+		uint32_t start = i, lit = 0;//literals up to the next worthwhile run
+		while(i < len && lit < RLE_MAX_LIT){
+			if(i+2 < len && src[i] == src[i+1] && src[i] == src[i+2])
+				break;
+			i++;
+			lit++;
+		}
+		dst[o++] = lit-1;
+		memcpy(dst+o, src+start, lit);
+		o += lit;
+	}
+	return o;
+}
+
+static uint32_t lz4_length(uint8_t *dst, uint32_t o, uint32_t n){//the extra length bytes after a 15 in the token
+	n -= 15;
+	while(n >= 255){
+		dst[o++] = 255;
+		n -= 255;
+	}
+	dst[o++] = n;
+	return o;
+}
+
+static uint32_t lz4_pack(const uint8_t *src, uint32_t len, uint8_t *dst){//greedy, LZ4 block format
+	static uint32_t table[1 << LZ4_HASH_BITS];
+	uint32_t i = 0, anchor = 0, o = 0;
+	uint32_t match_limit = len > 12 ? len-12 : 0;//the last match must start 12 bytes before the end
+
+	memset(table, 0xFF, sizeof(table));
+	while(i < match_limit){
+		uint32_t seq = src[i] | (src[i+1] << 8) | (src[i+2] << 16) | ((uint32_t)src[i+3] << 24);
+		uint32_t h = (seq*2654435761U) >> (32-LZ4_HASH_BITS);
+		uint32_t ref = table[h];
+		table[h] = i;
+		if(ref == 0xFFFFFFFF || i-ref > LZ4_MAX_OFFSET || memcmp(src+ref, src+i, LZ4_MIN_MATCH)){
+			i++;
+			continue;
+		}
+		uint32_t mlen = LZ4_MIN_MATCH;
+		while(i+mlen < len-5 && src[ref+mlen] == src[i+mlen])//the last 5 bytes stay literals
+			mlen++;
+
+		uint32_t lit = i-anchor;
+		uint32_t token = o++;
+		dst[token] = ((lit < 15 ? lit : 15) << 4) | (mlen-LZ4_MIN_MATCH < 15 ? mlen-LZ4_MIN_MATCH : 15);
+		if(lit >= 15)
+			o = lz4_length(dst, o, lit);
+		memcpy(dst+o, src+anchor, lit);
+		o += lit;
+		dst[o++] = (i-ref) & 0xFF;
+		dst[o++] = (i-ref) >> 8;
+		if(mlen-LZ4_MIN_MATCH >= 15)
+			o = lz4_length(dst, o, mlen-LZ4_MIN_MATCH);
+		i += mlen;
+		anchor = i;
+	}
+
+	uint32_t lit = len-anchor;//the rest as one last literal run
+	dst[o++] = (lit < 15 ? lit : 15) << 4;
+	if(lit >= 15)
+		o = lz4_length(dst, o, lit);
+	memcpy(dst+o, src+anchor, lit);
+	return o+lit;
+}
+
+static void check_raw(const char *path, const uint8_t *data, uint32_t size){//raw data the interpreter would take as packed
+	if(size >= PACK_HEADER_SIZE && data[0] == PACK_MAGIC0 && data[1] == PACK_MAGIC1 && (data[2] == PACK_RLE || data[2] == PACK_LZ4))
+		fprintf(stderr, "uzepak: warning: %s starts like packed data and won't load raw\n", path);
+}
+
+static void pack(uint8_t **data, uint32_t *size){//replaces the data with its smallest packed form, if there is one
+	uint32_t worst = *size+(*size/RLE_MAX_LIT)+(*size/255)+16+PACK_HEADER_SIZE;
+	uint8_t *rle = malloc(worst), *lz4 = malloc(worst);
+	if(rle == NULL || lz4 == NULL){
+		fprintf(stderr, "uzepak: out of memory\n");
+		exit(1);
+	}
+	uint32_t rle_len = rle_pack(*data, *size, rle+PACK_HEADER_SIZE);
+	uint32_t lz4_len = lz4_pack(*data, *size, lz4+PACK_HEADER_SIZE);
+	uint8_t *best = rle_len <= lz4_len ? rle : lz4;
+	uint32_t best_len = (rle_len <= lz4_len ? rle_len : lz4_len)+PACK_HEADER_SIZE;
+
+	if(best_len < *size){
+		best[0] = PACK_MAGIC0;
+		best[1] = PACK_MAGIC1;
+		best[2] = best == rle ? PACK_RLE : PACK_LZ4;
+		for(int i = 0; i < 4; i++)
+			best[3+i] = (*size >> (8*i)) & 0xFF;
+		free(*data);
+		*data = best;
+		*size = best_len;
+		free(best == rle ? lz4 : rle);
+	}else{
+		free(rle);
+		free(lz4);
+	}
+}
+
+static int is_program(const char *path){
+	size_t len = strlen(path);
+	if(len < 4)
+		return 0;
+	path += len-4;
+	return path[0] == '.' && ((toupper((unsigned char)path[1]) == 'B' && toupper((unsigned char)path[2]) == 'A' && toupper((unsigned char)path[3]) == 'S') ||
+		(toupper((unsigned char)path[1]) == 'B' && toupper((unsigned char)path[2]) == 'I' && toupper((unsigned char)path[3]) == 'N'));
+}
+
+static int compare_entries(const void *a, const void *b){
+	return strncmp(((const entry_t *)a)->name, ((const entry_t *)b)->name, PAK_NAME_LEN);
+}
+
+static void entry_name(char *dest, const char *path){
+	const char *base = path;
+	for(const char *p = path; *p; p++)
+		if(*p == '/' || *p == '\\')
+			base = p+1;
+	if(strlen(base) >= PAK_NAME_LEN){
+		fprintf(stderr, "uzepak: name too long (max %d): %s\n", PAK_NAME_LEN-1, base);
+		exit(1);
+	}
+	memset(dest, 0, PAK_NAME_LEN);
+	for(int i = 0; base[i]; i++)
+		dest[i] = toupper((unsigned char)base[i]);
+}
+
+int main(int argc, char **argv){
+	uint32_t align = 512;
+	int compress = 0;
+	int arg = 1;
+
+	if(argc == 4 && !strcmp(argv[1], "-z")){//one packed file
+		uint32_t size, raw;
+		uint8_t *data = load_file(argv[2], &size);
+		raw = size;
+		pack(&data, &size);
+		if(size == raw)
+			check_raw(argv[2], data, size);
+		FILE *out = fopen(argv[3], "wb");
+		if(out == NULL || fwrite(data, 1, size, out) != size || fclose(out) != 0){
+			perror(argv[3]);
+			return 1;
+		}
+		printf("%s: %lu -> %lu\n", argv[2], (unsigned long)raw, (unsigned long)size);
+		free(data);
+		return 0;
+	}
+
+	if(arg+1 < argc && !strcmp(argv[arg], "-a")){
+		align = strtoul(argv[arg+1], NULL, 0);
+		if(align == 0 || (align & (align-1))){
+			fprintf(stderr, "uzepak: alignment must be a power of two\n");
+			return 1;
+		}
+		arg += 2;
+	}
+	if(arg < argc && !strcmp(argv[arg], "-c")){
+		compress = 1;
+		arg++;
+	}
+	if(argc-arg < 2){
+		fprintf(stderr, "usage: uzepak [-a alignment] [-c] archive.pak file1 [file2 ...]\n");
+		fprintf(stderr, "       uzepak -z input output\n");
+		return 1;
+	}
+
+	const char *out_path = argv[arg++];
+	int count = argc-arg;
+	if(count > 0xFFFF){
+		fprintf(stderr, "uzepak: too many files\n");
+		return 1;
+	}
+	entry_t *entries = calloc(count, sizeof(entry_t));
+	if(entries == NULL){
+		fprintf(stderr, "uzepak: out of memory\n");
+		return 1;
+	}
+
+	for(int i = 0; i < count; i++){
+		entries[i].data = load_file(argv[arg+i], &entries[i].size);
+		uint32_t raw = entries[i].size;
+		if(compress && !is_program(argv[arg+i]))
+			pack(&entries[i].data, &entries[i].size);
+		if(entries[i].size == raw)
+			check_raw(argv[arg+i], entries[i].data, raw);
+		entries[i].path = argv[arg+i];
+		entry_name(entries[i].name, argv[arg+i]);
+	}
+
+	qsort(entries, count, sizeof(entry_t), compare_entries);
+	for(int i = 1; i < count; i++){
+		if(!compare_entries(&entries[i-1], &entries[i])){
+			fprintf(stderr, "uzepak: duplicate entry %s\n", entries[i].name);
+			return 1;
+		}
+	}
+
+	uint32_t pos = PAK_HEADER_SIZE+(uint32_t)count*PAK_ENTRY_SIZE;
+	for(int i = 0; i < count; i++){
+		pos = (pos+align-1) & ~(align-1);
+		entries[i].offset = pos;
+		pos += entries[i].size;
+	}
+
+	FILE *out = fopen(out_path, "wb");
+	if(out == NULL){
+		perror(out_path);
+		return 1;
+	}
+	fwrite("UZPK", 1, 4, out);
+	put16(out, PAK_VERSION);
+	put16(out, count);
+	for(int i = 0; i < count; i++){
+		fwrite(entries[i].name, 1, PAK_NAME_LEN, out);
+		put32(out, entries[i].offset);
+		put32(out, entries[i].size);
+	}
+
+	for(int i = 0; i < count; i++){
+		while((uint32_t)ftell(out) < entries[i].offset)//padding up to the alignment
+			fputc(0, out);
+		fwrite(entries[i].data, 1, entries[i].size, out);
+		free(entries[i].data);
+		printf("%-15s %8lu @ %lu\n", entries[i].name, (unsigned long)entries[i].size, (unsigned long)entries[i].offset);
+	}
+
+	if(fclose(out) != 0){
+		perror(out_path);
+		return 1;
+	}
+	free(entries);
+	return 0;
+}